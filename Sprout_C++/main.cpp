@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <cctype>
 #include <random>
@@ -9,15 +10,73 @@
 #include <fstream>
 #include <filesystem>
 #include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <functional>
+#include <charconv>
+#include <array>
+#include <algorithm>
+#include <memory_resource>
+#include <chrono>
+#include <atomic>
+#include <optional>
+#include <new>
+#include <cstdlib>
+#include <list>
+// Compressed files are opt-in, since they need extra libraries at link time:
+//   -DSPROUT_WITH_ZLIB ... -lz      reads and writes .gz
+//   -DSPROUT_WITH_ZSTD ... -lzstd   reads and writes .zst
+// A plain build reports such files as unsupported
+#ifdef SPROUT_WITH_ZLIB
+#define SPROUT_HAVE_ZLIB 1
+#include <zlib.h>
+#endif
+#ifdef SPROUT_WITH_ZSTD
+#define SPROUT_HAVE_ZSTD 1
+#include <zstd.h>
+#endif
+#if !defined(SPROUT_NO_MEMORY_METER) && (defined(__GLIBC__) || defined(__APPLE__) || defined(_WIN32))
+#define SPROUT_HAVE_MEMORY_METER 1
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
 
 using namespace std;
 
 // All possible token types in Sprout
 enum class TokenType {
-    // Keywords (4 vars, 8 standard functions and 4 file functions)
-    INT, STR, FLOAT, ARRAY,
+    // Keywords (5 vars, 8 standard functions, 6 file functions and 4 map functions)
+    INT, STR, FLOAT, ARRAY, MAP,
     PRINT, INPUT, IF, ELSE, JUMP, BREAK, RANDOM, LENGTH, ELIF,
-    READ, WRITE, MAKEFILE, DELFILE,
+    READ, READNUM, WRITE, MAKEFILE, DELFILE, EACH,
+    PUT, GET, DEL, HAS,
+    SLEEP, YIELD,
+    SORT, SORTDESC, SEARCH, FIND,
+    SPLIT, JOIN, SUBSTR, CONTAINS, REPLACE, TRIM, UPPER, LOWER,
+    FUNC, RETURN, IMPORT,
 
     // Identifiers / literals
     IDENT, NUMBER, STRING,
@@ -48,24 +107,261 @@ struct Token {
     int line;
 };
 
+/* =====================
+   MEMORY METER
+   - every operator new and delete in the process goes through here, so the
+     runtime knows how many heap bytes it holds (variables, temporaries,
+     tokens, AST nodes) and the most it ever held
+   - --max-memory makes the first allocation past the cap throw bad_alloc;
+     the interpreter reports it against the statement that asked for it.
+     Allocations succeed again once usage falls back under the cap
+   - the cost is one relaxed atomic add per allocation and per free
+   ===================== */
+struct MemoryMeter {
+    static inline atomic<int64_t> live{0}, peak{0};
+    static inline atomic<bool> over{false}; // the cap has tripped and not yet re-armed
+    static inline size_t limit = 0;         // --max-memory; 0 = no cap
+    static inline atomic<size_t> tokens{0}, syntaxTree{0}; // kept by compiled programs
+
+    // Throws bad_alloc on failure, or returns nullptr for nothrow new
+    static void* allocate(size_t n, bool nothrow = false) {
+        void* p = malloc(n ? n : 1);
+        if (!p) {
+            if (nothrow) return nullptr;
+            throw bad_alloc();
+        }
+#ifdef SPROUT_HAVE_MEMORY_METER
+        int64_t size = (int64_t)usable(p);
+        int64_t now = live.fetch_add(size, memory_order_relaxed) + size;
+        if (limit) {
+            if ((size_t)now > limit) {
+                // A nothrow caller falls back on its own (inplace_merge does), so the cap stays armed
+                if (nothrow) {
+                    live.fetch_sub(size, memory_order_relaxed);
+                    free(p);
+                    return nullptr;
+                }
+                // The first failure stops the script; its error message and unwinding may allocate
+                if (!over.exchange(true, memory_order_relaxed)) {
+                    live.fetch_sub(size, memory_order_relaxed);
+                    free(p);
+                    throw bad_alloc();
+                }
+            } else if (over.load(memory_order_relaxed)) {
+                over.store(false, memory_order_relaxed);
+            }
+        }
+        int64_t high = peak.load(memory_order_relaxed);
+        while (now > high && !peak.compare_exchange_weak(high, now, memory_order_relaxed)) {}
+#endif
+        return p;
+    }
+
+    static void release(void* p) noexcept {
+        if (!p) return;
+#ifdef SPROUT_HAVE_MEMORY_METER
+        live.fetch_sub((int64_t)usable(p), memory_order_relaxed);
+#endif
+        free(p);
+    }
+
+    static string outOfMemory(int line) {
+        if (limit && over.load(memory_order_relaxed)) {
+            return "Memory limit of " + to_string(limit) + " bytes (--max-memory) exceeded on line " + to_string(line);
+        }
+        return "Out of memory on line " + to_string(line);
+    }
+
+private:
+#ifdef SPROUT_HAVE_MEMORY_METER
+    static size_t usable(void* p) {
+#if defined(__APPLE__)
+        return malloc_size(p);
+#elif defined(_WIN32)
+        return _msize(p);
+#else
+        return malloc_usable_size(p);
+#endif
+    }
+#endif
+};
+
+void* operator new(size_t n) { return MemoryMeter::allocate(n); }
+void* operator new[](size_t n) { return MemoryMeter::allocate(n); }
+void* operator new(size_t n, const nothrow_t&) noexcept { return MemoryMeter::allocate(n, true); }
+void* operator new[](size_t n, const nothrow_t& tag) noexcept { return operator new(n, tag); }
+void operator delete(void* p) noexcept { MemoryMeter::release(p); }
+void operator delete[](void* p) noexcept { MemoryMeter::release(p); }
+void operator delete(void* p, size_t) noexcept { MemoryMeter::release(p); }
+void operator delete[](void* p, size_t) noexcept { MemoryMeter::release(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { MemoryMeter::release(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { MemoryMeter::release(p); }
+
+/* =====================
+   SCANNING KERNELS
+   The lexer's hot loops (whitespace, identifiers, digits, newline counting)
+   and substring search for the string built-ins look at 16 or 32 bytes per
+   step on x86. The widest kernel set the CPU
+   supports is picked once at startup; everything else uses the scalar loops.
+   ===================== */
+struct ScanKernels {
+    const char* name;
+    const char* (*skipSpace)(const char* p, const char* end);  // past ' ', \t, \n, \v, \f, \r
+    const char* (*skipAlnum)(const char* p, const char* end);  // past [A-Za-z0-9]
+    const char* (*skipDigits)(const char* p, const char* end); // past [0-9]
+    size_t (*countNewlines)(const char* p, const char* end);
+    // First occurrence of needle[0..len) in [p, end), or nullptr
+    const char* (*findSubstring)(const char* p, const char* end, const char* needle, size_t len);
+};
+
+static inline bool isSpaceByte(unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+static inline bool isAlnumByte(unsigned char c) { return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'); }
+static inline bool isDigitByte(unsigned char c) { return c >= '0' && c <= '9'; }
+
+static const char* skipSpaceScalar(const char* p, const char* end) {
+    while (p < end && isSpaceByte(*p)) p++;
+    return p;
+}
+
+static const char* skipAlnumScalar(const char* p, const char* end) {
+    while (p < end && isAlnumByte(*p)) p++;
+    return p;
+}
+
+static const char* skipDigitsScalar(const char* p, const char* end) {
+    while (p < end && isDigitByte(*p)) p++;
+    return p;
+}
+
+static size_t countNewlinesScalar(const char* p, const char* end) {
+    size_t n = 0;
+    while (p < end) {
+        const void* nl = memchr(p, '\n', end - p);
+        if (!nl) break;
+        n++;
+        p = (const char*)nl + 1;
+    }
+    return n;
+}
+
+static const char* findSubstringScalar(const char* p, const char* end, const char* needle, size_t len) {
+    if (len == 0) return p;
+    while ((size_t)(end - p) >= len) {
+        const char* hit = (const char*)memchr(p, needle[0], end - p - len + 1);
+        if (!hit) return nullptr;
+        if (memcmp(hit + 1, needle + 1, len - 1) == 0) return hit;
+        p = hit + 1;
+    }
+    return nullptr;
+}
+
+static const ScanKernels scalarKernels = {"scalar", skipSpaceScalar, skipAlnumScalar, skipDigitsScalar, countNewlinesScalar,
+                                          findSubstringScalar};
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SPROUT_SIMD_SCAN 1
+
+// Class masks use signed byte compares; bytes >= 0x80 are negative and never match.
+// Each kernel returns at the first byte outside the class, finishing the tail scalar.
+#define SPROUT_SCAN_KERNELS(W, VEC, LOAD, SET1, CMPEQ, CMPGT, OR, AND, MOVEMASK, ATTR)          \
+    ATTR static const char* skipSpace##W(const char* p, const char* end) {                      \
+        const VEC space = SET1(' '), lo = SET1('\t' - 1), hi = SET1('\r' + 1);                   \
+        for (; end - p >= W; p += W) {                                                           \
+            VEC v = LOAD((const VEC*)p);                                                         \
+            VEC in = OR(CMPEQ(v, space), AND(CMPGT(v, lo), CMPGT(hi, v)));                       \
+            uint32_t miss = ~(uint32_t)MOVEMASK(in) & (uint32_t)((1ull << W) - 1);              \
+            if (miss) return p + __builtin_ctz(miss);                                            \
+        }                                                                                        \
+        return skipSpaceScalar(p, end);                                                          \
+    }                                                                                            \
+    ATTR static const char* skipAlnum##W(const char* p, const char* end) {                      \
+        const VEC d0 = SET1('0' - 1), d9 = SET1('9' + 1), a = SET1('a' - 1), z = SET1('z' + 1);  \
+        const VEC fold = SET1(0x20);                                                             \
+        for (; end - p >= W; p += W) {                                                           \
+            VEC v = LOAD((const VEC*)p);                                                         \
+            VEC lower = OR(v, fold);                                                             \
+            VEC in = OR(AND(CMPGT(v, d0), CMPGT(d9, v)), AND(CMPGT(lower, a), CMPGT(z, lower))); \
+            uint32_t miss = ~(uint32_t)MOVEMASK(in) & (uint32_t)((1ull << W) - 1);              \
+            if (miss) return p + __builtin_ctz(miss);                                            \
+        }                                                                                        \
+        return skipAlnumScalar(p, end);                                                          \
+    }                                                                                            \
+    ATTR static const char* skipDigits##W(const char* p, const char* end) {                     \
+        const VEC d0 = SET1('0' - 1), d9 = SET1('9' + 1);                                        \
+        for (; end - p >= W; p += W) {                                                           \
+            VEC v = LOAD((const VEC*)p);                                                         \
+            uint32_t miss = ~(uint32_t)MOVEMASK(AND(CMPGT(v, d0), CMPGT(d9, v))) &              \
+                            (uint32_t)((1ull << W) - 1);                                         \
+            if (miss) return p + __builtin_ctz(miss);                                            \
+        }                                                                                        \
+        return skipDigitsScalar(p, end);                                                         \
+    }                                                                                            \
+    ATTR static size_t countNewlines##W(const char* p, const char* end) {                        \
+        const VEC nl = SET1('\n');                                                               \
+        size_t n = 0;                                                                            \
+        for (; end - p >= W; p += W)                                                             \
+            n += __builtin_popcount((uint32_t)MOVEMASK(CMPEQ(LOAD((const VEC*)p), nl)));        \
+        for (; p < end; ++p) n += *p == '\n';                                                    \
+        return n;                                                                                \
+    }                                                                                            \
+    /* Candidates must match the needle's first and last bytes; only those get a memcmp */      \
+    ATTR static const char* findSubstring##W(const char* p, const char* end, const char* needle, \
+                                             size_t len) {                                       \
+        if (len < 2) return findSubstringScalar(p, end, needle, len);                            \
+        const VEC first = SET1(needle[0]), last = SET1(needle[len - 1]);                        \
+        for (; (size_t)(end - p) >= len - 1 + W; p += W) {                                       \
+            VEC head = LOAD((const VEC*)p), tail = LOAD((const VEC*)(p + len - 1));              \
+            uint32_t hits = (uint32_t)MOVEMASK(AND(CMPEQ(head, first), CMPEQ(tail, last)));     \
+            while (hits) {                                                                       \
+                const char* at = p + __builtin_ctz(hits);                                        \
+                if (memcmp(at + 1, needle + 1, len - 2) == 0) return at;                         \
+                hits &= hits - 1;                                                                \
+            }                                                                                    \
+        }                                                                                        \
+        return findSubstringScalar(p, end, needle, len);                                         \
+    }
+
+SPROUT_SCAN_KERNELS(16, __m128i, _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_cmpgt_epi8,
+                    _mm_or_si128, _mm_and_si128, _mm_movemask_epi8, __attribute__((target("sse2"))))
+SPROUT_SCAN_KERNELS(32, __m256i, _mm256_loadu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_cmpgt_epi8,
+                    _mm256_or_si256, _mm256_and_si256, _mm256_movemask_epi8, __attribute__((target("avx2"))))
+#undef SPROUT_SCAN_KERNELS
+
+static const ScanKernels sse2Kernels = {"sse2", skipSpace16, skipAlnum16, skipDigits16, countNewlines16, findSubstring16};
+static const ScanKernels avx2Kernels = {"avx2", skipSpace32, skipAlnum32, skipDigits32, countNewlines32, findSubstring32};
+#endif
+
+static const ScanKernels& scanKernels() {
+    static const ScanKernels& chosen = []() -> const ScanKernels& {
+#ifdef SPROUT_SIMD_SCAN
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return avx2Kernels;
+        if (__builtin_cpu_supports("sse2")) return sse2Kernels;
+#endif
+        return scalarKernels;
+    }();
+    return chosen;
+}
+
 // Our Lexer class
 class Lexer {
     string src;  // source code
     size_t pos;  // current index
     int line;    // current line number
+    const ScanKernels& scan = scanKernels();
 
 public:
-    Lexer(const string& input) : src(input), pos(0), line(1) {}
+    Lexer(const string& input, int firstLine = 1) : src(input), pos(0), line(firstLine) {}
 
     // Get all tokens until END_OF_FILE
     vector<Token> tokenize() {
         vector<Token> tokens;
         Token tok = nextToken();
         while (tok.type != TokenType::END_OF_FILE) {
-            tokens.push_back(tok);
+            tokens.push_back(move(tok));
             tok = nextToken();
         }
-        tokens.push_back(tok); // push EOF
+        tokens.push_back(move(tok)); // push EOF
         return tokens;
     }
 
@@ -84,19 +380,47 @@ private:
         return c;
     }
 
+    const char* at(size_t i) const { return src.data() + i; }
+    const char* srcEnd() const { return src.data() + src.size(); }
+
     // Skip spaces and comments
     void skipWhitespace() {
         while (true) {
-            while (isspace(peek())) advance();
-            // handle // comments
+            size_t start = pos;
+            pos = scan.skipSpace(at(pos), srcEnd()) - src.data();
+            line += (int)scan.countNewlines(at(start), at(pos));
+            // handle // comments: jump to the newline ending them
             if (peek() == '/' && (pos + 1) < src.size() && src[pos + 1] == '/') {
-                while (peek() != '\n' && peek() != '\0') advance();
+                const void* nl = memchr(at(pos), '\n', src.size() - pos);
+                pos = nl ? (const char*)nl - src.data() : src.size();
                 continue;
             }
             break;
         }
     }
 
+    // Keywords; any other run of letters and digits is an identifier
+    static const unordered_map<string, TokenType>& keywords() {
+        static const unordered_map<string, TokenType> table = {
+            {"int", TokenType::INT}, {"str", TokenType::STR}, {"float", TokenType::FLOAT},
+            {"array", TokenType::ARRAY}, {"print", TokenType::PRINT}, {"input", TokenType::INPUT},
+            {"if", TokenType::IF}, {"else", TokenType::ELSE}, {"jump", TokenType::JUMP},
+            {"break", TokenType::BREAK}, {"random", TokenType::RANDOM}, {"read", TokenType::READ},
+            {"readnum", TokenType::READNUM}, {"len", TokenType::LENGTH},
+            {"write", TokenType::WRITE}, {"newfile", TokenType::MAKEFILE},
+            {"delfile", TokenType::DELFILE}, {"each", TokenType::EACH}, {"elif", TokenType::ELIF},
+            {"map", TokenType::MAP}, {"put", TokenType::PUT}, {"get", TokenType::GET},
+            {"del", TokenType::DEL}, {"has", TokenType::HAS}, {"sleep", TokenType::SLEEP},
+            {"yield", TokenType::YIELD}, {"sort", TokenType::SORT}, {"sortdesc", TokenType::SORTDESC},
+            {"search", TokenType::SEARCH}, {"find", TokenType::FIND}, {"split", TokenType::SPLIT},
+            {"join", TokenType::JOIN}, {"substr", TokenType::SUBSTR}, {"contains", TokenType::CONTAINS},
+            {"replace", TokenType::REPLACE}, {"trim", TokenType::TRIM}, {"upper", TokenType::UPPER},
+            {"lower", TokenType::LOWER}, {"func", TokenType::FUNC}, {"return", TokenType::RETURN},
+            {"import", TokenType::IMPORT}
+        };
+        return table;
+    }
+
     // Core: get the next token
     Token nextToken() {
         skipWhitespace();
@@ -105,48 +429,34 @@ private:
         if (c == '\0') return makeToken(TokenType::END_OF_FILE, "");
 
         // Identifiers or keywords
-        if (isalpha(c)) {
-            string word;
-            while (isalnum(peek())) word += advance();
-            if (word == "int")    return makeToken(TokenType::INT, word);
-            if (word == "str")    return makeToken(TokenType::STR, word);
-            if (word == "float")  return makeToken(TokenType::FLOAT, word);
-            if (word == "array")  return makeToken(TokenType::ARRAY, word);
-            if (word == "print")  return makeToken(TokenType::PRINT, word);
-            if (word == "input")  return makeToken(TokenType::INPUT, word);
-            if (word == "if")     return makeToken(TokenType::IF, word);
-            if (word == "else")   return makeToken(TokenType::ELSE, word);
-            if (word == "jump")   return makeToken(TokenType::JUMP, word);
-            if (word == "break")  return makeToken(TokenType::BREAK, word);
-            if (word == "random") return makeToken(TokenType::RANDOM, word);
-            if (word == "read")   return makeToken(TokenType::READ, word);
-            if (word == "len") return makeToken(TokenType::LENGTH, word);
-            if (word == "write") return makeToken(TokenType::WRITE, word);
-            if (word == "newfile") return makeToken(TokenType::MAKEFILE, word);
-            if (word == "delfile") return makeToken(TokenType::DELFILE, word);
-            if (word == "elif") return makeToken(TokenType::ELIF, word);
-            return makeToken(TokenType::IDENT, word);
+        if (isalpha((unsigned char)c)) {
+            size_t start = pos;
+            pos = scan.skipAlnum(at(pos), srcEnd()) - src.data();
+            string word = src.substr(start, pos - start);
+            auto kw = keywords().find(word);
+            if (kw != keywords().end()) return makeToken(kw->second, move(word));
+            return makeToken(TokenType::IDENT, move(word));
         }
 
         // Numbers
-        if (isdigit(c)) {
-            string num;
-            while (isdigit(peek())) num += advance();
+        if (isdigit((unsigned char)c)) {
+            size_t start = pos;
+            pos = scan.skipDigits(at(pos), srcEnd()) - src.data();
             // Support optional fractional part: digits '.' digits
-            if (peek() == '.' && (pos + 1) < src.size() && isdigit(src[pos + 1])) {
-                num += advance(); // consume '.'
-                while (isdigit(peek())) num += advance();
+            if (peek() == '.' && (pos + 1) < src.size() && isdigit((unsigned char)src[pos + 1])) {
+                pos = scan.skipDigits(at(pos + 1), srcEnd()) - src.data();
             }
-            return makeToken(TokenType::NUMBER, num);
+            return makeToken(TokenType::NUMBER, src.substr(start, pos - start));
         }
 
-        // Strings "..."
+        // Strings "..." (may span lines; an unterminated string runs to end of file)
         if (c == '"') {
-            advance(); // skip "
-            string value;
-            while (peek() != '"' && peek() != '\0') value += advance();
-            advance(); // skip closing "
-            return makeToken(TokenType::STRING, value);
+            size_t start = pos + 1;
+            const void* close = memchr(at(start), '"', src.size() - start);
+            size_t stop = close ? (const char*)close - src.data() : src.size();
+            line += (int)scan.countNewlines(at(start), at(stop));
+            pos = close ? stop + 1 : src.size();
+            return makeToken(TokenType::STRING, src.substr(start, stop - start));
         }
 
         // Two-character and single-character operators/symbols
@@ -192,11 +502,107 @@ private:
         return makeToken(TokenType::UNKNOWN, string(1, c));
     }
 
-    Token makeToken(TokenType type, const string& text) {
-        return Token{type, text, line};
+    Token makeToken(TokenType type, string text) {
+        return Token{type, move(text), line};
     }
 };
 
+// Whether a stretch of source ends inside a string literal, given whether it
+// starts inside one. Outside strings, "//" comments hide quotes up to the newline
+static bool endsInString(const char* p, const char* end, bool inString) {
+    while (p < end) {
+        if (inString) {
+            const void* close = memchr(p, '"', end - p);
+            if (!close) return true;
+            p = (const char*)close + 1;
+            inString = false;
+            continue;
+        }
+        while (p < end && *p != '"' && *p != '/') p++;
+        if (p == end) break;
+        if (*p == '"') {
+            inString = true;
+            p++;
+        } else if (p + 1 < end && p[1] == '/') {
+            const void* nl = memchr(p, '\n', end - p);
+            if (!nl) break;
+            p = (const char*)nl + 1;
+        } else {
+            p++;
+        }
+    }
+    return inString;
+}
+
+// Lex a large source on several threads. Chunks start just after a newline that
+// is outside any string literal, so no token straddles a boundary; the result is
+// the same token stream the serial lexer produces
+vector<Token> tokenizeParallel(const string& src, size_t threads = thread::hardware_concurrency()) {
+    const size_t minChunk = 1 << 20;
+    threads = max<size_t>(1, min<size_t>(threads, src.size() / minChunk));
+    if (threads == 1) return Lexer(src).tokenize();
+
+    vector<size_t> bounds{0};
+    for (size_t i = 1; i < threads; ++i) {
+        size_t at = src.size() * i / threads;
+        const void* nl = memchr(src.data() + at, '\n', src.size() - at);
+        size_t cut = nl ? (const char*)nl - src.data() + 1 : src.size();
+        if (cut > bounds.back() && cut < src.size()) bounds.push_back(cut);
+    }
+    bounds.push_back(src.size());
+    size_t chunks = bounds.size() - 1;
+
+    auto runAll = [&chunks](const function<void(size_t)>& work) {
+        vector<thread> pool;
+        for (size_t c = 1; c < chunks; ++c) pool.emplace_back(work, c);
+        work(0);
+        for (auto& t : pool) t.join();
+    };
+
+    // Pass 1: per chunk, newline count and exit state for either entry state
+    const ScanKernels& scan = scanKernels();
+    vector<size_t> newlines(chunks);
+    vector<array<bool, 2>> exitInString(chunks);
+    runAll([&](size_t c) {
+        const char* begin = src.data() + bounds[c];
+        const char* end = src.data() + bounds[c + 1];
+        newlines[c] = scan.countNewlines(begin, end);
+        exitInString[c] = {endsInString(begin, end, false), endsInString(begin, end, true)};
+    });
+
+    // Chain the states; a chunk that starts inside a multi-line string is merged
+    // into the chunk before it
+    vector<size_t> starts{0};
+    vector<int> firstLines{1};
+    bool inString = false;
+    size_t line = 1;
+    for (size_t c = 0; c < chunks; ++c) {
+        if (c > 0 && !inString) {
+            starts.push_back(bounds[c]);
+            firstLines.push_back((int)line);
+        }
+        inString = exitInString[c][inString];
+        line += newlines[c];
+    }
+    starts.push_back(src.size());
+    chunks = starts.size() - 1;
+
+    // Pass 2: lex the chunks; every chunk but the last ends at a newline, so only
+    // the last one's END_OF_FILE token is kept
+    vector<vector<Token>> parts(chunks);
+    runAll([&](size_t c) {
+        parts[c] = Lexer(src.substr(starts[c], starts[c + 1] - starts[c]), firstLines[c]).tokenize();
+        if (c + 1 < chunks) parts[c].pop_back();
+    });
+
+    size_t total = 0;
+    for (auto& part : parts) total += part.size();
+    vector<Token> tokens;
+    tokens.reserve(total);
+    for (auto& part : parts) move(part.begin(), part.end(), back_inserter(tokens));
+    return tokens;
+}
+
 // Forward declarations
 struct Expr;
 struct Stmt;
@@ -207,18 +613,69 @@ using StmtPtr = shared_ptr<Stmt>;
 /* =====================
    EXPRESSIONS (things that produce values)
    ===================== */
+// Types the checker can prove for an expression or variable.
+// BOTTOM = no information yet, DYNAMIC = only known at runtime
+enum class StaticType { BOTTOM, INT, FLOAT, STR, ARRAY, MAP, DYNAMIC };
+
 struct Expr {
     virtual ~Expr() = default;
+    StaticType staticType = StaticType::DYNAMIC; // filled in by the TypeChecker
+    int depth = 1; // height of the tree below this node; kept by the parser only
 };
 
 struct NumberExpr : Expr {
     double value;
-    NumberExpr(double v) : value(v) {}
+    bool isInt;       // literal written without a fractional part
+    int64_t intValue; // only read when isInt
+    NumberExpr(double v) : value(v), isInt(false), intValue(0) {}
+    NumberExpr(int64_t v) : value((double)v), isInt(true), intValue(v) {}
+};
+
+// Pool of string constants shared by every program in the process.
+// Equal literals intern to one string, so two of them compare by address.
+// Strings are reference-counted by the literals using them and leave the
+// pool with the last one, so a long-running server does not keep the
+// literals of every script it ever compiled
+class StringPool {
+public:
+    static shared_ptr<const string> intern(const string& text) {
+        auto& pool = shared();
+        lock_guard<mutex> lock(pool.guard);
+        auto it = pool.strings.find(text);
+        if (it != pool.strings.end()) {
+            if (auto live = it->second.lock()) return live;
+            pool.strings.erase(it); // its string is on the way out; the key must not outlive it
+        }
+        shared_ptr<const string> str(new string(text), release);
+        pool.strings.emplace(*str, str); // the key views the pooled string itself
+        return str;
+    }
+
+private:
+    mutex guard;
+    unordered_map<string_view, weak_ptr<const string>> strings;
+
+    static void release(const string* str) {
+        auto& pool = shared();
+        {
+            lock_guard<mutex> lock(pool.guard);
+            // A newer string for the same text may have taken the entry meanwhile
+            auto it = pool.strings.find(*str);
+            if (it != pool.strings.end() && it->first.data() == str->data()) pool.strings.erase(it);
+        }
+        delete str;
+    }
+
+    static StringPool& shared() {
+        static StringPool* pool = new StringPool; // never destroyed: literals may outlive static destructors
+        return *pool;
+    }
 };
 
 struct StringExpr : Expr {
-    string value;
-    StringExpr(string v) : value(move(v)) {}
+    shared_ptr<const string> text; // interned
+    const string& value;           // *text
+    StringExpr(const string& v) : text(StringPool::intern(v)), value(*text) {}
 };
 
 struct ArrayExpr : Expr {
@@ -226,25 +683,78 @@ struct ArrayExpr : Expr {
     ArrayExpr(vector<ExprPtr> v) : values(move(v)) {}
 };
 
+// Evaluates to a new, empty map
+struct MapExpr : Expr {
+};
+
 struct ArrayAccessExpr : Expr {
     string arrayName;
     ExprPtr index;
     ArrayAccessExpr(string name, ExprPtr idx) : arrayName(move(name)), index(move(idx)) {}
 };
 
+// arr[from:to]; a missing bound means the start or end of the array
+struct SliceExpr : Expr {
+    string arrayName;
+    ExprPtr from, to;
+    SliceExpr(string name, ExprPtr f, ExprPtr t) : arrayName(move(name)), from(move(f)), to(move(t)) {}
+};
+
 
 
 struct VarExpr : Expr {
     string name;
+    int slot = -1; // frame slot when this names a function local, set by the FunctionResolver
     VarExpr(string n) : name(move(n)) {}
 };
 
+struct FuncStmt;
+
+// name(args); fn is linked by the FunctionResolver
+struct CallExpr : Expr {
+    string name;
+    vector<ExprPtr> args;
+    int line;
+    FuncStmt* fn = nullptr;
+    CallExpr(string n, vector<ExprPtr> a, int l) : name(move(n)), args(move(a)), line(l) {}
+};
+
+// Specialized forms a BinaryExpr gets rewritten into the first time it runs
+// with a given operand type combination (see Interpreter::quicken)
+enum class QuickKind {
+    UNQUICKENED,    // never evaluated yet
+    GENERIC,        // guard failed too often, always take the generic path
+    NUM_ADD, NUM_SUB, NUM_MUL, NUM_DIV,     // NUM_* = numbers with at least one float
+    NUM_LT, NUM_GT, NUM_LE, NUM_GE, NUM_EQ, NUM_NE,
+    STR_EQ, STR_NE, STR_LT, STR_GT, STR_LE, STR_GE,
+    INT_ADD, INT_SUB, INT_MUL, INT_DIV,
+    INT_LT, INT_GT, INT_LE, INT_GE, INT_EQ, INT_NE,
+    CONCAT          // "+" with at least one non-number operand
+};
+
 struct BinaryExpr : Expr {
     string op;       // "+", "-", "*", "/", "="
     ExprPtr left;
     ExprPtr right;
-    BinaryExpr(string o, ExprPtr l, ExprPtr r)
-        : op(move(o)), left(move(l)), right(move(r)) {}
+    int line;
+
+    // Quickening state, rewritten in place by the interpreter. Imported modules
+    // run on several threads at once, so these are atomics; a stale read only
+    // costs one generic evaluation
+    atomic<QuickKind> quick{QuickKind::UNQUICKENED};
+    atomic<size_t> hits{0};   // evaluations served by the specialized form
+    atomic<size_t> misses{0}; // guard failures that fell back to the generic path
+    bool proven = false; // TypeChecker proved the operand types, no guard needed
+
+    // Hits are only counted for --quicken-stats, so hot shared code is not written to
+    static inline bool countHits = false;
+
+    BinaryExpr(string o, ExprPtr l, ExprPtr r, int ln = 0)
+        : op(move(o)), left(move(l)), right(move(r)), line(ln) {}
+
+    void hit() {
+        if (countHits) hits.fetch_add(1, memory_order_relaxed);
+    }
 };
 
 /* =====================
@@ -260,6 +770,7 @@ struct DeclStmt : Stmt {
     string type;
     string name;
     ExprPtr init;
+    int slot = -1; // frame slot inside a function, -1 for globals
     DeclStmt(string t, string n, ExprPtr e, int l)
         : type(move(t)), name(move(n)), init(move(e)) { line = l; }
 };
@@ -275,6 +786,8 @@ struct ArrayDeclStmt : Stmt {
 struct AssignStmt : Stmt {
     string name;
     ExprPtr expr;
+    StaticType target = StaticType::DYNAMIC; // numeric type the value is converted to, set by TypeChecker
+    int slot = -1; // frame slot inside a function, -1 for globals
     AssignStmt(string n, ExprPtr e, int l)
         : name(move(n)), expr(move(e)) { line = l; }
 };
@@ -322,10 +835,22 @@ struct BreakStmt : Stmt {
     BreakStmt(int l) { line = l; }
 };
 
+// sleep : milliseconds
+struct SleepStmt : Stmt {
+    ExprPtr millis;
+    SleepStmt(ExprPtr m, int l) : millis(move(m)) { line = l; }
+};
+
+// yield: let other scripts on the same scheduler run
+struct YieldStmt : Stmt {
+    YieldStmt(int l) { line = l; }
+};
+
 struct ReadStmt : Stmt {
     string varName;
     string fileName;
-    ReadStmt(string v, string f, int l) : varName(move(v)), fileName(move(f)) { line = l; }
+    bool numeric; // readnum : parse the file as numbers into a dense array
+    ReadStmt(string v, string f, int l, bool n = false) : varName(move(v)), fileName(move(f)), numeric(n) { line = l; }
 };
 
 struct LengthStmt : Stmt {
@@ -350,10 +875,230 @@ struct DelfileStmt : Stmt {
     DelfileStmt(string f, int l) : filename(move(f)) { line = l; }
 };
 
+// each : var, "file" [, blockSize]:  body  ;
+// Runs body once per line (or per array of up to blockSize lines) streamed from the file
+struct EachStmt : Stmt {
+    string varName;
+    string fileName; // "-" reads stdin
+    int blockSize;   // 0 = one line at a time as a string
+    vector<StmtPtr> body;
+    EachStmt(string v, string f, int b, int l) : varName(move(v)), fileName(move(f)), blockSize(b) { line = l; }
+};
+
+// put : map, key, value
+struct MapPutStmt : Stmt {
+    string mapName;
+    ExprPtr key;
+    ExprPtr value;
+    MapPutStmt(string m, ExprPtr k, ExprPtr v, int l) : mapName(move(m)), key(move(k)), value(move(v)) { line = l; }
+};
+
+// get : var, map, key
+struct MapGetStmt : Stmt {
+    string varName;
+    string mapName;
+    ExprPtr key;
+    MapGetStmt(string v, string m, ExprPtr k, int l) : varName(move(v)), mapName(move(m)), key(move(k)) { line = l; }
+};
+
+// del : map, key
+struct MapDelStmt : Stmt {
+    string mapName;
+    ExprPtr key;
+    MapDelStmt(string m, ExprPtr k, int l) : mapName(move(m)), key(move(k)) { line = l; }
+};
+
+// has : var, map, key
+struct MapHasStmt : Stmt {
+    string varName;
+    string mapName;
+    ExprPtr key;
+    MapHasStmt(string v, string m, ExprPtr k, int l) : varName(move(v)), mapName(move(m)), key(move(k)) { line = l; }
+};
+
+// sort : array / sortdesc : array, in place; numbers order before strings
+struct SortStmt : Stmt {
+    string arrayName;
+    bool descending;
+    SortStmt(string a, bool d, int l) : arrayName(move(a)), descending(d) { line = l; }
+};
+
+// search : var, array, value (binary search, array sorted ascending);
+// var receives the index found, or -1
+struct SearchStmt : Stmt {
+    string varName;
+    string arrayName;
+    ExprPtr value;
+    SearchStmt(string v, string a, ExprPtr x, int l)
+        : varName(move(v)), arrayName(move(a)), value(move(x)) { line = l; }
+};
+
+// String built-ins, all "op : var, args...":
+//   split : arr, text, sep        join : var, arr, sep        substr : var, text, start, length
+//   find : var, text or arr, x    contains : var, text, x     replace : var, text, from, to
+//   trim : var, text              upper : var, text           lower : var, text
+enum class StringOp { SPLIT, JOIN, SUBSTR, FIND, CONTAINS, REPLACE, TRIM, UPPER, LOWER };
+
+struct StringOpStmt : Stmt {
+    StringOp op;
+    string varName;
+    vector<ExprPtr> args;
+    StringOpStmt(StringOp o, string v, vector<ExprPtr> a, int l) : op(o), varName(move(v)), args(move(a)) { line = l; }
+};
+
+// func name(params):  body  ;
+// Parameters, variables declared in the body and each loop variables are local;
+// other names are globals
+struct FuncStmt : Stmt {
+    string name;
+    vector<string> params;
+    vector<StmtPtr> body;
+
+    // Set by the FunctionResolver
+    unordered_map<string, int> slots;       // frame slot of each local, parameters first
+    unordered_map<int, size_t> lineToIndex; // jump targets in the body
+    ExprPtr inlineBody; // the returned expression, when calls are expanded in place
+
+    FuncStmt(string n, vector<string> p, int l) : name(move(n)), params(move(p)) { line = l; }
+};
+
+// return : value  (or just return)
+struct ReturnStmt : Stmt {
+    ExprPtr expr;
+    bool tail = false; // returns a call, which reuses the caller's frame
+    ReturnStmt(ExprPtr e, int l) : expr(move(e)) { line = l; }
+};
+
+// A call on its own, result discarded
+struct CallStmt : Stmt {
+    ExprPtr call;
+    CallStmt(ExprPtr c, int l) : call(move(c)) { line = l; }
+};
+
+struct Module;
+
+// import : "file.spt"  makes the functions of another file callable
+struct ImportStmt : Stmt {
+    string fileName;
+    shared_ptr<const Module> module; // set when the program is compiled
+    ImportStmt(string f, int l) : fileName(move(f)) { line = l; }
+};
+
+// Visits a statement and every statement nested in its bodies
+static void forEachStmt(const StmtPtr& stmt, const function<void(const StmtPtr&)>& visit) {
+    visit(stmt);
+    if (auto ifs = dynamic_cast<IfStmt*>(stmt.get())) {
+        for (auto& branch : ifs->branches)
+            for (auto& s : branch.second) forEachStmt(s, visit);
+    } else if (auto e = dynamic_cast<EachStmt*>(stmt.get())) {
+        for (auto& s : e->body) forEachStmt(s, visit);
+    } else if (auto f = dynamic_cast<FuncStmt*>(stmt.get())) {
+        for (auto& s : f->body) forEachStmt(s, visit);
+    }
+}
+
+// Visits the expressions a statement holds itself, not those of nested statements
+static void forEachExpr(const StmtPtr& stmt, const function<void(ExprPtr&)>& visit) {
+    Stmt* st = stmt.get();
+    if (auto d = dynamic_cast<DeclStmt*>(st)) visit(d->init);
+    else if (auto a = dynamic_cast<AssignStmt*>(st)) visit(a->expr);
+    else if (auto aa = dynamic_cast<ArrayAssignStmt*>(st)) {
+        visit(aa->index);
+        visit(aa->expr);
+    }
+    else if (auto p = dynamic_cast<PrintStmt*>(st)) visit(p->expr);
+    else if (auto sl = dynamic_cast<SleepStmt*>(st)) visit(sl->millis);
+    else if (auto mp = dynamic_cast<MapPutStmt*>(st)) {
+        visit(mp->key);
+        visit(mp->value);
+    }
+    else if (auto mg = dynamic_cast<MapGetStmt*>(st)) visit(mg->key);
+    else if (auto md = dynamic_cast<MapDelStmt*>(st)) visit(md->key);
+    else if (auto mh = dynamic_cast<MapHasStmt*>(st)) visit(mh->key);
+    else if (auto se = dynamic_cast<SearchStmt*>(st)) visit(se->value);
+    else if (auto so = dynamic_cast<StringOpStmt*>(st)) {
+        for (auto& a : so->args) visit(a);
+    }
+    else if (auto ifs = dynamic_cast<IfStmt*>(st)) {
+        for (auto& branch : ifs->branches) visit(branch.first);
+    }
+    else if (auto r = dynamic_cast<ReturnStmt*>(st)) visit(r->expr);
+    else if (auto c = dynamic_cast<CallStmt*>(st)) visit(c->call);
+}
+
+// Visits the variable names a statement uses by name (not those inside its expressions)
+static void forEachName(const StmtPtr& stmt, const function<void(const string&)>& visit) {
+    Stmt* st = stmt.get();
+    if (auto d = dynamic_cast<DeclStmt*>(st)) visit(d->name);
+    else if (auto a = dynamic_cast<AssignStmt*>(st)) visit(a->name);
+    else if (auto aa = dynamic_cast<ArrayAssignStmt*>(st)) visit(aa->arrayName);
+    else if (auto in = dynamic_cast<InputStmt*>(st)) visit(in->name);
+    else if (auto r = dynamic_cast<RandomStmt*>(st)) visit(r->name);
+    else if (auto rd = dynamic_cast<ReadStmt*>(st)) visit(rd->varName);
+    else if (auto l = dynamic_cast<LengthStmt*>(st)) {
+        visit(l->varName);
+        visit(l->ArrayName);
+    }
+    else if (auto w = dynamic_cast<WriteStmt*>(st)) visit(w->ArrayName);
+    else if (auto e = dynamic_cast<EachStmt*>(st)) visit(e->varName);
+    else if (auto mp = dynamic_cast<MapPutStmt*>(st)) visit(mp->mapName);
+    else if (auto mg = dynamic_cast<MapGetStmt*>(st)) {
+        visit(mg->varName);
+        visit(mg->mapName);
+    }
+    else if (auto md = dynamic_cast<MapDelStmt*>(st)) visit(md->mapName);
+    else if (auto mh = dynamic_cast<MapHasStmt*>(st)) {
+        visit(mh->varName);
+        visit(mh->mapName);
+    }
+    else if (auto so = dynamic_cast<SortStmt*>(st)) visit(so->arrayName);
+    else if (auto se = dynamic_cast<SearchStmt*>(st)) {
+        visit(se->varName);
+        visit(se->arrayName);
+    }
+    else if (auto so = dynamic_cast<StringOpStmt*>(st)) visit(so->varName);
+}
+
+// Visits the direct operands of an expression
+static void forEachOperand(const ExprPtr& expr, const function<void(ExprPtr&)>& visit) {
+    Expr* e = expr.get();
+    if (auto b = dynamic_cast<BinaryExpr*>(e)) {
+        visit(b->left);
+        visit(b->right);
+    } else if (auto a = dynamic_cast<ArrayExpr*>(e)) {
+        for (auto& v : a->values) visit(v);
+    } else if (auto aa = dynamic_cast<ArrayAccessExpr*>(e)) {
+        visit(aa->index);
+    } else if (auto sl = dynamic_cast<SliceExpr*>(e)) {
+        visit(sl->from);
+        visit(sl->to);
+    } else if (auto c = dynamic_cast<CallExpr*>(e)) {
+        for (auto& a : c->args) visit(a);
+    }
+}
+
 class Parser {
     vector<Token> tokens;
     size_t pos;
 
+    // Deepest nesting of blocks, brackets and operator chains a script may use.
+    // Parsing, checking and evaluating recurse once per level, and the stacks of
+    // server coroutines are far smaller than a thread's
+    static constexpr int MAX_NESTING = 1000;
+    int nesting = 0;
+
+    // One level of parser recursion, for as long as it lives
+    struct Nest {
+        Parser& parser;
+        explicit Nest(Parser& p) : parser(p) {
+            if (++parser.nesting > MAX_NESTING) {
+                --parser.nesting;
+                parser.tooDeep();
+            }
+        }
+        ~Nest() { --parser.nesting; }
+    };
+
 public:
     Parser(vector<Token> t) : tokens(move(t)), pos(0) {}
 
@@ -398,24 +1143,63 @@ private:
         return pos >= tokens.size() || tokens[pos].type == TokenType::END_OF_FILE;
     }
 
+    [[noreturn]] void tooDeep() {
+        int line = pos > 0 && pos <= tokens.size() ? tokens[pos - 1].line : peek().line;
+        throw runtime_error("Too deeply nested on line " + to_string(line));
+    }
+
+    // Gives node the height of its tallest child plus one
+    ExprPtr deepen(ExprPtr node, initializer_list<const ExprPtr*> children) {
+        for (const ExprPtr* c : children) {
+            if (*c) node->depth = max(node->depth, (*c)->depth + 1);
+        }
+        if (node->depth > MAX_NESTING) tooDeep();
+        return node;
+    }
+
     // === Parsing ===
     StmtPtr parseStmt() {
+        Nest level(*this); // blocks nest through here
         if (match(TokenType::INT))    return parseDecl("int");
         if (match(TokenType::STR))    return parseDecl("str");
         if (match(TokenType::FLOAT))  return parseDecl("float");
         if (match(TokenType::ARRAY))  return parseArray();
+        if (match(TokenType::MAP))    return parseMap();
         if (match(TokenType::PRINT))  return parsePrint();
         if (match(TokenType::INPUT))  return parseInput();
         if (match(TokenType::IF))     return parseIf();
         if (match(TokenType::ELIF))   return parseElif();
         if (match(TokenType::JUMP))   return parseJump();
         if (match(TokenType::BREAK))  return parseBreak();
+        if (match(TokenType::SLEEP))  return parseSleep();
+        if (match(TokenType::YIELD))  return parseYield();
         if (match(TokenType::RANDOM)) return parseRandom();
         if (match(TokenType::READ))   return parseRead();
+        if (match(TokenType::READNUM)) return parseRead(true);
         if (match(TokenType::LENGTH)) return parseLength();
         if (match(TokenType::WRITE)) return parseWrite();
         if (match(TokenType::MAKEFILE)) return parseMakefile();
         if (match(TokenType::DELFILE)) return parseDelfile();
+        if (match(TokenType::EACH)) return parseEach();
+        if (match(TokenType::PUT)) return parsePut();
+        if (match(TokenType::GET)) return parseGet();
+        if (match(TokenType::DEL)) return parseDel();
+        if (match(TokenType::HAS)) return parseHas();
+        if (match(TokenType::SORT)) return parseSort(false);
+        if (match(TokenType::SORTDESC)) return parseSort(true);
+        if (match(TokenType::SEARCH)) return parseSearch();
+        if (match(TokenType::FIND)) return parseStringOp(StringOp::FIND, 2);
+        if (match(TokenType::SPLIT)) return parseStringOp(StringOp::SPLIT, 2);
+        if (match(TokenType::JOIN)) return parseStringOp(StringOp::JOIN, 2);
+        if (match(TokenType::SUBSTR)) return parseStringOp(StringOp::SUBSTR, 3);
+        if (match(TokenType::CONTAINS)) return parseStringOp(StringOp::CONTAINS, 2);
+        if (match(TokenType::REPLACE)) return parseStringOp(StringOp::REPLACE, 3);
+        if (match(TokenType::TRIM)) return parseStringOp(StringOp::TRIM, 1);
+        if (match(TokenType::UPPER)) return parseStringOp(StringOp::UPPER, 1);
+        if (match(TokenType::LOWER)) return parseStringOp(StringOp::LOWER, 1);
+        if (match(TokenType::FUNC)) return parseFunc();
+        if (match(TokenType::RETURN)) return parseReturn();
+        if (match(TokenType::IMPORT)) return parseImport();
 
         // Otherwise → assignment
         return parseAssign();
@@ -439,6 +1223,18 @@ private:
         return make_shared<BreakStmt>(breakTok.line);
     }
 
+    StmtPtr parseSleep() {
+        Token sleepTok = tokens[pos-1];
+        match(TokenType::COLON);
+        ExprPtr millis = parseExpr();
+        return make_shared<SleepStmt>(millis, sleepTok.line);
+    }
+
+    StmtPtr parseYield() {
+        Token yieldTok = tokens[pos-1];
+        return make_shared<YieldStmt>(yieldTok.line);
+    }
+
     StmtPtr parseDecl(string type) {
         Token typeTok = tokens[pos-1]; // Get type token for line number
         Token name = advance();
@@ -450,8 +1246,12 @@ private:
     StmtPtr parseArray() {
         Token arrayTok = tokens[pos-1]; // Get array token for line number
         Token name = advance();
-        match(TokenType::EQ);
+        bool init = match(TokenType::EQ);
         vector<ExprPtr> values;
+        // array part = whole[a:b]
+        if (init && check(TokenType::IDENT)) {
+            return make_shared<DeclStmt>("array", name.text, parseExpr(), arrayTok.line);
+        }
         if (match(TokenType::LPAREN)) {
             while (!check(TokenType::RPAREN)) {
                 values.push_back(parseExpr());
@@ -463,8 +1263,96 @@ private:
         return make_shared<DeclStmt>("array", name.text, make_shared<ArrayExpr>(values), arrayTok.line);
     }
 
+    // map name  |  map name = ()
+    StmtPtr parseMap() {
+        Token mapTok = tokens[pos-1];
+        Token name = advance();
+        if (match(TokenType::EQ)) {
+            match(TokenType::LPAREN);
+            match(TokenType::RPAREN);
+        }
+        return make_shared<DeclStmt>("map", name.text, make_shared<MapExpr>(), mapTok.line);
+    }
+
+    StmtPtr parsePut() {
+        Token putTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token mapName = advance();
+        match(TokenType::COMMA);
+        ExprPtr key = parseExpr();
+        match(TokenType::COMMA);
+        ExprPtr value = parseExpr();
+        return make_shared<MapPutStmt>(mapName.text, key, value, putTok.line);
+    }
+
+    StmtPtr parseGet() {
+        Token getTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token varName = advance();
+        match(TokenType::COMMA);
+        Token mapName = advance();
+        match(TokenType::COMMA);
+        ExprPtr key = parseExpr();
+        return make_shared<MapGetStmt>(varName.text, mapName.text, key, getTok.line);
+    }
+
+    StmtPtr parseDel() {
+        Token delTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token mapName = advance();
+        match(TokenType::COMMA);
+        ExprPtr key = parseExpr();
+        return make_shared<MapDelStmt>(mapName.text, key, delTok.line);
+    }
+
+    StmtPtr parseHas() {
+        Token hasTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token varName = advance();
+        match(TokenType::COMMA);
+        Token mapName = advance();
+        match(TokenType::COMMA);
+        ExprPtr key = parseExpr();
+        return make_shared<MapHasStmt>(varName.text, mapName.text, key, hasTok.line);
+    }
+
+    StmtPtr parseSort(bool descending) {
+        Token sortTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token arrayName = advance();
+        return make_shared<SortStmt>(arrayName.text, descending, sortTok.line);
+    }
+
+    StmtPtr parseSearch() {
+        Token searchTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token varName = advance();
+        match(TokenType::COMMA);
+        Token arrayName = advance();
+        match(TokenType::COMMA);
+        ExprPtr value = parseExpr();
+        return make_shared<SearchStmt>(varName.text, arrayName.text, value, searchTok.line);
+    }
+
+    StmtPtr parseStringOp(StringOp op, int argCount) {
+        Token opTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token varName = advance();
+        vector<ExprPtr> args;
+        for (int i = 0; i < argCount; ++i) {
+            match(TokenType::COMMA);
+            args.push_back(parseExpr());
+        }
+        return make_shared<StringOpStmt>(op, varName.text, args, opTok.line);
+    }
+
     StmtPtr parseAssign() {
         Token nameTok = advance(); // Get name token for line number
+
+        // A call on its own: name(args)
+        if (match(TokenType::LPAREN)) {
+            return make_shared<CallStmt>(parseCall(nameTok), nameTok.line);
+        }
         
         // Check if this is array element assignment: name[index] = value
         if (match(TokenType::LBRACKET)) {
@@ -497,13 +1385,13 @@ private:
         return make_shared<InputStmt>(name.text, question.text, inputTok.line);
     }
 
-    StmtPtr parseRead() {
+    StmtPtr parseRead(bool numeric = false) {
         Token readTok = tokens[pos-1];
         match(TokenType::COLON);
         Token varName = advance();
         match(TokenType::COMMA);
         Token fileName = advance();
-        return make_shared<ReadStmt>(varName.text, fileName.text, readTok.line);
+        return make_shared<ReadStmt>(varName.text, fileName.text, readTok.line, numeric);
     }
 
     StmtPtr parseRandom() {
@@ -549,6 +1437,83 @@ private:
         return make_shared<DelfileStmt>(filename.text, delfileTok.line);
     }
 
+    StmtPtr parseEach() {
+        Token eachTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token varName = advance();
+        match(TokenType::COMMA);
+        Token fileName = advance();
+        int blockSize = 0;
+        if (match(TokenType::COMMA)) {
+            Token size = advance();
+            if (size.type != TokenType::NUMBER) {
+                throw runtime_error("Expected block size after 'each : " + varName.text + ", " + fileName.text + ",'");
+            }
+            blockSize = stoi(size.text);
+        }
+        match(TokenType::COLON);
+        auto node = make_shared<EachStmt>(varName.text, fileName.text, blockSize, eachTok.line);
+        while (!check(TokenType::SEMICOLON) && !check(TokenType::END_OF_FILE)) {
+            node->body.push_back(parseStmt());
+        }
+        // consume the ';' that terminates the body
+        match(TokenType::SEMICOLON);
+        return node;
+    }
+
+    StmtPtr parseFunc() {
+        Token funcTok = tokens[pos-1];
+        Token name = advance();
+        if (name.type != TokenType::IDENT) {
+            throw runtime_error("Expected function name after 'func' on line " + to_string(funcTok.line));
+        }
+        vector<string> params;
+        match(TokenType::LPAREN);
+        while (check(TokenType::IDENT)) {
+            params.push_back(advance().text);
+            if (!match(TokenType::COMMA)) break;
+        }
+        match(TokenType::RPAREN);
+        match(TokenType::COLON);
+        auto node = make_shared<FuncStmt>(name.text, move(params), funcTok.line);
+        while (!check(TokenType::SEMICOLON) && !check(TokenType::END_OF_FILE)) {
+            node->body.push_back(parseStmt());
+        }
+        // consume the ';' that terminates the body
+        match(TokenType::SEMICOLON);
+        return node;
+    }
+
+    StmtPtr parseReturn() {
+        Token returnTok = tokens[pos-1];
+        ExprPtr value;
+        if (match(TokenType::COLON)) value = parseExpr();
+        return make_shared<ReturnStmt>(value, returnTok.line);
+    }
+
+    StmtPtr parseImport() {
+        Token importTok = tokens[pos-1];
+        match(TokenType::COLON);
+        Token fileName = advance();
+        if (fileName.type != TokenType::STRING) {
+            throw runtime_error("Expected a file name after 'import :' on line " + to_string(importTok.line));
+        }
+        return make_shared<ImportStmt>(fileName.text, importTok.line);
+    }
+
+    // Arguments of name(...), after the '('
+    ExprPtr parseCall(const Token& name) {
+        vector<ExprPtr> args;
+        while (!check(TokenType::RPAREN) && !check(TokenType::END_OF_FILE)) {
+            args.push_back(parseExpr());
+            if (!match(TokenType::COMMA)) break;
+        }
+        match(TokenType::RPAREN);
+        auto call = make_shared<CallExpr>(name.text, move(args), name.line);
+        for (auto& a : call->args) deepen(call, {&a});
+        return call;
+    }
+
     StmtPtr parseElif() {
         Token elifTok = tokens[pos-1]; // Get elif token for line number
         auto node = make_shared<IfStmt>(elifTok.line);
@@ -627,6 +1592,7 @@ private:
 
     // === Expressions ===
     ExprPtr parseExpr() {
+        Nest level(*this);
         return parseEquality();
     }
 
@@ -636,7 +1602,7 @@ private:
         while (match(TokenType::EQEQ) || match(TokenType::NE)) {
             Token op = tokens[pos - 1];
             ExprPtr right = parseComparison();
-            left = make_shared<BinaryExpr>(op.text, left, right);
+            left = deepen(make_shared<BinaryExpr>(op.text, left, right, op.line), {&left, &right});
         }
         return left;
     }
@@ -647,7 +1613,7 @@ private:
         while (match(TokenType::LT) || match(TokenType::GT) || match(TokenType::LE) || match(TokenType::GE)) {
             Token op = tokens[pos - 1];
             ExprPtr right = parseAddSub();
-            left = make_shared<BinaryExpr>(op.text, left, right);
+            left = deepen(make_shared<BinaryExpr>(op.text, left, right, op.line), {&left, &right});
         }
         return left;
     }
@@ -657,7 +1623,7 @@ private:
         while (match(TokenType::PLUS) || match(TokenType::MINUS)) {
             Token op = tokens[pos - 1];
             ExprPtr right = parseTerm();
-            left = make_shared<BinaryExpr>(op.text, left, right);
+            left = deepen(make_shared<BinaryExpr>(op.text, left, right, op.line), {&left, &right});
         }
         return left;
     }
@@ -667,15 +1633,27 @@ private:
         while (match(TokenType::STAR) || match(TokenType::SLASH)) {
             Token op = tokens[pos - 1];
             ExprPtr right = parseFactor();
-            left = make_shared<BinaryExpr>(op.text, left, right);
+            left = deepen(make_shared<BinaryExpr>(op.text, left, right, op.line), {&left, &right});
         }
         return left;
     }
 
     ExprPtr parseFactor() {
         Token tok = advance();
-        if (tok.type == TokenType::NUMBER)
-            return make_shared<NumberExpr>(stod(tok.text));
+        if (tok.type == TokenType::NUMBER) {
+            const char* first = tok.text.data();
+            const char* last = first + tok.text.size();
+            if (tok.text.find('.') != string::npos) {
+                double d = 0;
+                from_chars(first, last, d);
+                return make_shared<NumberExpr>(d);
+            }
+            int64_t i = 0;
+            if (from_chars(first, last, i).ec == errc::result_out_of_range) {
+                throw runtime_error("Integer literal out of range on line " + to_string(tok.line) + ": " + tok.text);
+            }
+            return make_shared<NumberExpr>(i);
+        }
         if (tok.type == TokenType::STRING)
             return make_shared<StringExpr>(tok.text);
         // Do not treat 'float' keyword as a literal
@@ -684,10 +1662,16 @@ private:
             string name = tok.text;
             // Check for array access: identifier[index]
             if (match(TokenType::LBRACKET)) {
-                ExprPtr index = parseExpr();
+                ExprPtr index = check(TokenType::COLON) ? nullptr : parseExpr();
+                if (match(TokenType::COLON)) {
+                    ExprPtr to = check(TokenType::RBRACKET) ? nullptr : parseExpr();
+                    match(TokenType::RBRACKET);
+                    return deepen(make_shared<SliceExpr>(name, index, to), {&index, &to});
+                }
                 match(TokenType::RBRACKET);
-                return make_shared<ArrayAccessExpr>(name, index);
+                return deepen(make_shared<ArrayAccessExpr>(name, index), {&index});
             }
+            if (match(TokenType::LPAREN)) return parseCall(tok);
             return make_shared<VarExpr>(name);
         }
 
@@ -702,471 +1686,5873 @@ private:
     }
 };
 /* =====================
-   INTERPRETER
-   - walks the AST
-   - keeps variables in memory
+   FUNCTION RESOLVER
+   - links calls to their definitions and checks argument counts
+   - expands calls to small non-recursive functions in place
+   - gives parameters and locals fixed slots in the call frame
+   Runs before the TypeChecker, so expanded calls get checked and quickened
    ===================== */
+class FunctionResolver {
+    static constexpr int INLINE_MAX_NODES = 16;
 
-// Update the variable storage to support arrays
-class Interpreter {
-    unordered_map<string, variant<double, string, vector<variant<double, string>>>> variables;
+    unordered_map<string, FuncStmt*> functions;
+    unordered_map<const FuncStmt*, int> expanding; // 1 = in progress, 2 = done
+    FuncStmt* current = nullptr; // function whose body is being resolved
+    int line = 0;                // of the statement being resolved
+    bool isModule = false;
+    vector<string> errors;
 
 public:
-    void run(const vector<StmtPtr>& program) {
-        // Build line number to statement index mapping
-        unordered_map<int, size_t> lineToIndex;
-        for (size_t i = 0; i < program.size(); i++) {
-            lineToIndex[program[i]->line] = i;
+    // Returns the list of errors; empty means every call can be made.
+    // Imported functions are already resolved and are only linked to, never changed.
+    // A module is type-checked on its own, so its functions may only use their own
+    // parameters and locals
+    vector<string> resolve(const vector<StmtPtr>& program, const unordered_map<string, FuncStmt*>& imported = {},
+                           bool module = false) {
+        isModule = module;
+        for (auto& [name, f] : imported) {
+            functions.emplace(name, f);
+            expanding[f] = 2;
         }
-
-        size_t currentStmt = 0;
-        while (currentStmt < program.size()) {
-            try {
-                currentStmt = exec(program[currentStmt], program, lineToIndex, currentStmt);
-            } catch (const JumpException& e) {
-                // Handle jump by finding the target line
-                auto it = lineToIndex.find(e.targetLine);
-                if (it != lineToIndex.end()) {
-                    currentStmt = it->second;
-                } else {
-                    cerr << "Error: Cannot jump to line " << e.targetLine << " - line not found\n";
-                    break;
-                }
-            } catch (const BreakException&) {
-                break; // Exit the program
+        for (auto& s : program) {
+            if (auto f = dynamic_cast<FuncStmt*>(s.get())) {
+                if (!functions.emplace(f->name, f).second) error(f->line, "function '" + f->name + "' is already defined");
             }
         }
+        for (auto& [name, f] : functions) expandFunction(f);
+        for (auto& s : program) {
+            if (!dynamic_cast<FuncStmt*>(s.get())) expandStmt(s);
+        }
+        for (auto& s : program) {
+            if (auto f = dynamic_cast<FuncStmt*>(s.get())) resolveFunction(*f);
+            else if (isModule && !dynamic_cast<ImportStmt*>(s.get())) error(s->line, "a module can only hold func and import statements");
+            else resolveStmt(s, true);
+        }
+        return errors;
     }
 
 private:
-    // Exception classes for control flow
-    class JumpException : public exception {
-    public:
-        int targetLine;
+    void error(int line, const string& msg) {
+        errors.push_back("Error on line " + to_string(line) + ": " + msg);
+    }
+
+    // === Inlining ===
+    void expandFunction(FuncStmt* f) {
+        if (expanding[f]) return; // done, or recursive and left as a call
+        expanding[f] = 1;
+        for (auto& s : f->body) expandStmt(s);
+
+        // A body that only returns an expression of its parameters replaces its calls
+        if (f->body.size() == 1) {
+            auto r = dynamic_cast<ReturnStmt*>(f->body[0].get());
+            int nodes = 0;
+            if (r && r->expr && inlinable(r->expr, *f, nodes)) f->inlineBody = r->expr;
+        }
+        expanding[f] = 2;
+    }
+
+    void expandStmt(const StmtPtr& stmt) {
+        forEachStmt(stmt, [this](const StmtPtr& s) {
+            forEachExpr(s, [this](ExprPtr& e) { expandExpr(e); });
+        });
+    }
+
+    void expandExpr(ExprPtr& expr) {
+        if (!expr) return;
+        forEachOperand(expr, [this](ExprPtr& e) { expandExpr(e); });
+        auto c = dynamic_cast<CallExpr*>(expr.get());
+        if (!c) return;
+        auto it = functions.find(c->name);
+        if (it == functions.end()) return; // reported when resolving
+        FuncStmt* f = it->second;
+        expandFunction(f);
+        if (!f->inlineBody || c->args.size() != f->params.size()) return;
+
+        // Arguments are substituted unevaluated: each must be safe to evaluate as often as it is used
+        for (size_t i = 0; i < c->args.size(); ++i) {
+            int uses = countUses(f->inlineBody, f->params[i]);
+            if (uses == 1 ? hasCall(c->args[i]) : !isLeaf(c->args[i])) return;
+        }
+        expr = substitute(f->inlineBody, *f, c->args);
+    }
+
+    static bool inlinable(const ExprPtr& expr, const FuncStmt& f, int& nodes) {
+        if (++nodes > INLINE_MAX_NODES) return false;
+        if (dynamic_cast<NumberExpr*>(expr.get()) || dynamic_cast<StringExpr*>(expr.get())) return true;
+        if (auto v = dynamic_cast<VarExpr*>(expr.get())) {
+            return find(f.params.begin(), f.params.end(), v->name) != f.params.end();
+        }
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) {
+            return inlinable(b->left, f, nodes) && inlinable(b->right, f, nodes);
+        }
+        return false;
+    }
+
+    static bool isLeaf(const ExprPtr& expr) {
+        return dynamic_cast<NumberExpr*>(expr.get()) || dynamic_cast<StringExpr*>(expr.get()) ||
+               dynamic_cast<VarExpr*>(expr.get());
+    }
+
+    static bool hasCall(const ExprPtr& expr) {
+        if (!expr) return false;
+        if (dynamic_cast<CallExpr*>(expr.get())) return true;
+        bool found = false;
+        forEachOperand(expr, [&found](ExprPtr& e) { found = found || hasCall(e); });
+        return found;
+    }
+
+    static int countUses(const ExprPtr& expr, const string& name) {
+        if (auto v = dynamic_cast<VarExpr*>(expr.get())) return v->name == name ? 1 : 0;
+        int uses = 0;
+        forEachOperand(expr, [&](ExprPtr& e) { uses += countUses(e, name); });
+        return uses;
+    }
+
+    // Copy of an inline body with parameters replaced by the call's arguments.
+    // Binary nodes are copied because each keeps its own quickening state
+    static ExprPtr substitute(const ExprPtr& expr, const FuncStmt& f, const vector<ExprPtr>& args) {
+        if (auto v = dynamic_cast<VarExpr*>(expr.get())) {
+            return args[find(f.params.begin(), f.params.end(), v->name) - f.params.begin()];
+        }
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) {
+            return make_shared<BinaryExpr>(b->op, substitute(b->left, f, args), substitute(b->right, f, args), b->line);
+        }
+        // Literals are copied too: the body may belong to a module other programs are compiling
+        if (auto n = dynamic_cast<NumberExpr*>(expr.get())) return make_shared<NumberExpr>(*n);
+        return make_shared<StringExpr>(static_cast<const StringExpr&>(*expr));
+    }
+
+    // === Slots and links ===
+    void resolveFunction(FuncStmt& f) {
+        current = &f;
+        for (auto& p : f.params) {
+            if (!f.slots.emplace(p, (int)f.slots.size()).second) {
+                error(f.line, "parameter '" + p + "' of function '" + f.name + "' is listed twice");
+            }
+        }
+        for (auto& s : f.body) {
+            forEachStmt(s, [&f](const StmtPtr& st) {
+                if (auto d = dynamic_cast<DeclStmt*>(st.get())) f.slots.emplace(d->name, (int)f.slots.size());
+                else if (auto e = dynamic_cast<EachStmt*>(st.get())) f.slots.emplace(e->varName, (int)f.slots.size());
+            });
+        }
+        for (size_t i = 0; i < f.body.size(); ++i) f.lineToIndex[f.body[i]->line] = i;
+        for (auto& s : f.body) resolveStmt(s, false);
+        current = nullptr;
+    }
+
+    int slotOf(const string& name) const {
+        if (!current) return -1;
+        auto it = current->slots.find(name);
+        return it == current->slots.end() ? -1 : it->second;
+    }
+
+    void resolveStmt(const StmtPtr& stmt, bool topLevel) {
+        forEachStmt(stmt, [&](const StmtPtr& s) {
+            if (auto f = dynamic_cast<FuncStmt*>(s.get())) {
+                error(f->line, "function '" + f->name + "' must be defined at the top level");
+            } else if ((s != stmt || !topLevel) && dynamic_cast<ImportStmt*>(s.get())) {
+                error(s->line, "import must be at the top level");
+            } else if (auto d = dynamic_cast<DeclStmt*>(s.get())) {
+                d->slot = slotOf(d->name);
+            } else if (auto a = dynamic_cast<AssignStmt*>(s.get())) {
+                a->slot = slotOf(a->name);
+            } else if (auto r = dynamic_cast<ReturnStmt*>(s.get())) {
+                if (!current) error(r->line, "return outside a function");
+                r->tail = dynamic_cast<CallExpr*>(r->expr.get()) != nullptr;
+            }
+            if (isModule && current) {
+                forEachName(s, [&](const string& name) { requireLocal(name, s->line); });
+            }
+            line = s->line;
+            forEachExpr(s, [this](ExprPtr& e) { resolveExpr(e); });
+        });
+    }
+
+    void requireLocal(const string& name, int at) {
+        if (slotOf(name) < 0) {
+            error(at, "'" + name + "' is not a parameter or local of '" + current->name + "'; module functions cannot use globals");
+        }
+    }
+
+    void resolveExpr(ExprPtr& expr) {
+        if (!expr) return;
+        forEachOperand(expr, [this](ExprPtr& e) { resolveExpr(e); });
+        if (auto v = dynamic_cast<VarExpr*>(expr.get())) {
+            v->slot = slotOf(v->name);
+            if (isModule && current) requireLocal(v->name, line);
+        } else if (auto aa = dynamic_cast<ArrayAccessExpr*>(expr.get())) {
+            if (isModule && current) requireLocal(aa->arrayName, line);
+        } else if (auto sl = dynamic_cast<SliceExpr*>(expr.get())) {
+            if (isModule && current) requireLocal(sl->arrayName, line);
+        } else if (auto c = dynamic_cast<CallExpr*>(expr.get())) {
+            auto it = functions.find(c->name);
+            if (it == functions.end()) {
+                error(c->line, "undefined function '" + c->name + "'");
+                return;
+            }
+            c->fn = it->second;
+            if (c->args.size() != c->fn->params.size()) {
+                error(c->line, "function '" + c->name + "' takes " + to_string(c->fn->params.size()) +
+                               " arguments, got " + to_string(c->args.size()));
+            }
+        }
+    }
+};
+
+/* =====================
+   TYPE CHECKER
+   - propagates declared types through the program
+   - reports ill-typed code before it runs
+   - marks binary expressions whose operand types are proven
+   ===================== */
+class TypeChecker {
+    unordered_map<string, StaticType> declared; // types from int/str/float/array declarations
+    unordered_map<string, StaticType> inferred; // types of undeclared variables, from their assignments
+    vector<string> errors;
+    bool reporting = false; // only the final pass records errors and annotates nodes
+
+public:
+    // Returns the list of type errors; empty means the program is well-typed
+    vector<string> check(const vector<StmtPtr>& program) {
+        for (auto& s : program) collectDecls(s);
+
+        // Flow-insensitive: jumps can reach any statement, so iterate to a fixpoint
+        bool changed = true;
+        for (int i = 0; changed && i < 16; ++i) {
+            changed = false;
+            for (auto& s : program) changed |= inferStmt(s);
+        }
+
+        reporting = true;
+        for (auto& s : program) inferStmt(s);
+        return errors;
+    }
+
+    static const char* typeName(StaticType t) {
+        switch (t) {
+            case StaticType::BOTTOM: return "undefined";
+            case StaticType::INT: return "int";
+            case StaticType::FLOAT: return "float";
+            case StaticType::STR: return "str";
+            case StaticType::ARRAY: return "array";
+            case StaticType::MAP: return "map";
+            case StaticType::DYNAMIC: return "dynamic";
+        }
+        return "?";
+    }
+
+private:
+    static bool isNumeric(StaticType t) { return t == StaticType::INT || t == StaticType::FLOAT; }
+    static bool isContainer(StaticType t) { return t == StaticType::ARRAY || t == StaticType::MAP; }
+
+    // Least upper bound: int and float meet in float, anything else mixed is dynamic
+    static StaticType join(StaticType a, StaticType b) {
+        if (a == StaticType::BOTTOM) return b;
+        if (b == StaticType::BOTTOM) return a;
+        if (a == b) return a;
+        if (isNumeric(a) && isNumeric(b)) return StaticType::FLOAT;
+        return StaticType::DYNAMIC;
+    }
+
+    static StaticType fromDecl(const string& type) {
+        if (type == "int") return StaticType::INT;
+        if (type == "float") return StaticType::FLOAT;
+        if (type == "str") return StaticType::STR;
+        if (type == "array") return StaticType::ARRAY;
+        if (type == "map") return StaticType::MAP;
+        return StaticType::DYNAMIC;
+    }
+
+    // A value of type 'from' may be stored in a variable of type 'to'
+    static bool assignable(StaticType to, StaticType from) {
+        if (to == StaticType::DYNAMIC || from == StaticType::DYNAMIC || from == StaticType::BOTTOM) return true;
+        if (isNumeric(to) && isNumeric(from)) return true;
+        return to == from;
+    }
+
+    void error(int line, const string& msg) {
+        if (reporting) errors.push_back("Type error on line " + to_string(line) + ": " + msg);
+    }
+
+    void collectDecls(const StmtPtr& stmt) {
+        if (auto d = dynamic_pointer_cast<DeclStmt>(stmt)) {
+            StaticType t = fromDecl(d->type);
+            auto it = declared.find(d->name);
+            // Redeclaring with a different type leaves the variable dynamic
+            declared[d->name] = (it == declared.end() || it->second == t) ? t : StaticType::DYNAMIC;
+        } else if (auto ifs = dynamic_pointer_cast<IfStmt>(stmt)) {
+            for (auto& branch : ifs->branches)
+                for (auto& s : branch.second) collectDecls(s);
+        } else if (auto e = dynamic_pointer_cast<EachStmt>(stmt)) {
+            for (auto& s : e->body) collectDecls(s);
+        } else if (auto f = dynamic_pointer_cast<FuncStmt>(stmt)) {
+            // Arguments can be anything; locals share the type of any global with their name
+            for (auto& p : f->params) declared[p] = StaticType::DYNAMIC;
+            for (auto& s : f->body) collectDecls(s);
+        }
+    }
+
+    StaticType varType(const string& name) {
+        auto d = declared.find(name);
+        if (d != declared.end()) return d->second;
+        auto i = inferred.find(name);
+        if (i != inferred.end()) return i->second;
+        return StaticType::BOTTOM;
+    }
+
+    // Record that 'name' is assigned a value of type t; returns true if the inferred type changed
+    bool define(const string& name, StaticType t, int line) {
+        auto d = declared.find(name);
+        if (d != declared.end()) {
+            if (!assignable(d->second, t)) {
+                error(line, string("cannot assign ") + typeName(t) + " to " + typeName(d->second) + " variable '" + name + "'");
+            }
+            return false;
+        }
+        StaticType old = varType(name);
+        StaticType joined = join(old, t);
+        inferred[name] = joined;
+        return joined != old;
+    }
+
+    bool inferStmt(const StmtPtr& stmt) {
+        if (auto d = dynamic_pointer_cast<DeclStmt>(stmt)) {
+            StaticType declType = fromDecl(d->type);
+            StaticType t = inferExpr(d->init, d->line);
+            if (!assignable(declType, t)) {
+                error(d->line, string("cannot initialize ") + d->type + " '" + d->name + "' with " + typeName(t));
+            }
+            return false;
+        }
+        if (auto a = dynamic_pointer_cast<AssignStmt>(stmt)) {
+            bool changed = define(a->name, inferExpr(a->expr, a->line), a->line);
+            if (reporting) {
+                StaticType t = varType(a->name);
+                a->target = isNumeric(t) ? t : StaticType::DYNAMIC;
+            }
+            return changed;
+        }
+        if (auto aa = dynamic_pointer_cast<ArrayAssignStmt>(stmt)) {
+            requireArray(aa->arrayName, aa->line);
+            requireIndex(inferExpr(aa->index, aa->line), aa->line);
+            StaticType t = inferExpr(aa->expr, aa->line);
+            if (isContainer(t)) error(aa->line, string("cannot assign ") + typeName(t) + " to array element");
+            return false;
+        }
+        if (auto p = dynamic_pointer_cast<PrintStmt>(stmt)) {
+            inferExpr(p->expr, p->line);
+            return false;
+        }
+        if (auto in = dynamic_pointer_cast<InputStmt>(stmt)) {
+            // Numeric variables get the input converted, everything else receives a string
+            StaticType t = varType(in->name);
+            if (isContainer(t)) error(in->line, string("cannot read input into ") + typeName(t) + " '" + in->name + "'");
+            return define(in->name, isNumeric(t) ? t : StaticType::STR, in->line);
+        }
+        if (auto r = dynamic_pointer_cast<RandomStmt>(stmt)) {
+            return define(r->name, StaticType::INT, r->line);
+        }
+        if (auto sl = dynamic_pointer_cast<SleepStmt>(stmt)) {
+            StaticType t = inferExpr(sl->millis, sl->line);
+            if (t == StaticType::STR || isContainer(t)) error(sl->line, string("sleep needs milliseconds, got ") + typeName(t));
+            return false;
+        }
+        if (auto rd = dynamic_pointer_cast<ReadStmt>(stmt)) {
+            // Reading into a map loads key/value pairs, anything else becomes an array of lines
+            StaticType t = (!rd->numeric && varType(rd->varName) == StaticType::MAP) ? StaticType::MAP : StaticType::ARRAY;
+            return define(rd->varName, t, rd->line);
+        }
+        if (auto l = dynamic_pointer_cast<LengthStmt>(stmt)) {
+            requireContainer(l->ArrayName, l->line);
+            return define(l->varName, StaticType::INT, l->line);
+        }
+        if (auto w = dynamic_pointer_cast<WriteStmt>(stmt)) {
+            requireContainer(w->ArrayName, w->line);
+            return false;
+        }
+        if (auto e = dynamic_pointer_cast<EachStmt>(stmt)) {
+            bool changed = define(e->varName, e->blockSize > 0 ? StaticType::ARRAY : StaticType::STR, e->line);
+            for (auto& s : e->body) changed |= inferStmt(s);
+            return changed;
+        }
+        if (auto mp = dynamic_pointer_cast<MapPutStmt>(stmt)) {
+            requireMap(mp->mapName, mp->line);
+            requireKey(inferExpr(mp->key, mp->line), mp->line);
+            StaticType t = inferExpr(mp->value, mp->line);
+            if (isContainer(t)) error(mp->line, string("cannot store ") + typeName(t) + " as a map value");
+            return false;
+        }
+        if (auto mg = dynamic_pointer_cast<MapGetStmt>(stmt)) {
+            requireMap(mg->mapName, mg->line);
+            requireKey(inferExpr(mg->key, mg->line), mg->line);
+            return define(mg->varName, StaticType::DYNAMIC, mg->line); // map values are mixed
+        }
+        if (auto md = dynamic_pointer_cast<MapDelStmt>(stmt)) {
+            requireMap(md->mapName, md->line);
+            requireKey(inferExpr(md->key, md->line), md->line);
+            return false;
+        }
+        if (auto mh = dynamic_pointer_cast<MapHasStmt>(stmt)) {
+            requireMap(mh->mapName, mh->line);
+            requireKey(inferExpr(mh->key, mh->line), mh->line);
+            return define(mh->varName, StaticType::INT, mh->line);
+        }
+        if (auto so = dynamic_pointer_cast<SortStmt>(stmt)) {
+            requireArray(so->arrayName, so->line);
+            return false;
+        }
+        if (auto se = dynamic_pointer_cast<SearchStmt>(stmt)) {
+            requireArray(se->arrayName, se->line);
+            StaticType t = inferExpr(se->value, se->line);
+            if (isContainer(t)) error(se->line, string("cannot search an array for ") + typeName(t));
+            return define(se->varName, StaticType::INT, se->line);
+        }
+        if (auto so = dynamic_pointer_cast<StringOpStmt>(stmt)) {
+            vector<StaticType> types;
+            for (auto& a : so->args) types.push_back(inferExpr(a, so->line));
+            // The first argument is the text; join takes an array and find either
+            bool arrayFirst = so->op == StringOp::JOIN || (so->op == StringOp::FIND && types[0] == StaticType::ARRAY);
+            for (size_t i = 0; i < types.size(); ++i) {
+                if (i == 0 && arrayFirst) {
+                    if (types[0] != StaticType::ARRAY && types[0] != StaticType::DYNAMIC)
+                        error(so->line, string("expected an array, got ") + typeName(types[0]));
+                } else if (isContainer(types[i])) {
+                    error(so->line, string("expected a string, got ") + typeName(types[i]));
+                }
+            }
+            if (so->op == StringOp::SUBSTR) {
+                requireIndex(types[1], so->line);
+                requireIndex(types[2], so->line);
+            }
+            StaticType result = StaticType::STR;
+            if (so->op == StringOp::SPLIT) result = StaticType::ARRAY;
+            if (so->op == StringOp::FIND || so->op == StringOp::CONTAINS) result = StaticType::INT;
+            return define(so->varName, result, so->line);
+        }
+        if (auto f = dynamic_pointer_cast<FuncStmt>(stmt)) {
+            bool changed = false;
+            for (auto& s : f->body) changed |= inferStmt(s);
+            return changed;
+        }
+        if (auto r = dynamic_pointer_cast<ReturnStmt>(stmt)) {
+            if (r->expr) inferExpr(r->expr, r->line);
+            return false;
+        }
+        if (auto c = dynamic_pointer_cast<CallStmt>(stmt)) {
+            inferExpr(c->call, c->line);
+            return false;
+        }
+        if (auto ifs = dynamic_pointer_cast<IfStmt>(stmt)) {
+            bool changed = false;
+            for (auto& branch : ifs->branches) {
+                if (branch.first) {
+                    StaticType c = inferExpr(branch.first, ifs->line);
+                    if (isContainer(c)) error(ifs->line, string(typeName(c)) + " used as a condition");
+                }
+                for (auto& s : branch.second) changed |= inferStmt(s);
+            }
+            return changed;
+        }
+        return false;
+    }
+
+    void requireArray(const string& name, int line) {
+        StaticType t = varType(name);
+        if (t == StaticType::BOTTOM) error(line, "undefined array '" + name + "'");
+        else if (t != StaticType::ARRAY && t != StaticType::DYNAMIC)
+            error(line, "variable '" + name + "' is " + typeName(t) + ", not an array");
+    }
+
+    void requireMap(const string& name, int line) {
+        StaticType t = varType(name);
+        if (t == StaticType::BOTTOM) error(line, "undefined map '" + name + "'");
+        else if (t != StaticType::MAP && t != StaticType::DYNAMIC)
+            error(line, "variable '" + name + "' is " + typeName(t) + ", not a map");
+    }
+
+    // len and write accept arrays and maps
+    void requireContainer(const string& name, int line) {
+        StaticType t = varType(name);
+        if (t == StaticType::BOTTOM) error(line, "undefined variable '" + name + "'");
+        else if (!isContainer(t) && t != StaticType::DYNAMIC)
+            error(line, "variable '" + name + "' is " + typeName(t) + ", not an array or map");
+    }
+
+    void requireKey(StaticType t, int line) {
+        if (isContainer(t)) error(line, string("map key must be a number or string, not ") + typeName(t));
+    }
+
+    void requireIndex(StaticType t, int line) {
+        if (t == StaticType::STR || isContainer(t))
+            error(line, string("array index must be a number, not ") + typeName(t));
+    }
+
+    StaticType inferExpr(const ExprPtr& expr, int line) {
+        if (!expr) return StaticType::DYNAMIC;
+        StaticType t = inferExprUncached(expr, line);
+        if (reporting) expr->staticType = (t == StaticType::BOTTOM) ? StaticType::DYNAMIC : t;
+        return t;
+    }
+
+    StaticType inferExprUncached(const ExprPtr& expr, int line) {
+        if (auto n = dynamic_pointer_cast<NumberExpr>(expr)) {
+            return n->isInt ? StaticType::INT : StaticType::FLOAT;
+        }
+        if (dynamic_pointer_cast<StringExpr>(expr)) return StaticType::STR;
+        if (auto a = dynamic_pointer_cast<ArrayExpr>(expr)) {
+            for (auto& v : a->values) inferExpr(v, line);
+            return StaticType::ARRAY;
+        }
+        if (dynamic_pointer_cast<MapExpr>(expr)) return StaticType::MAP;
+        if (auto aa = dynamic_pointer_cast<ArrayAccessExpr>(expr)) {
+            requireArray(aa->arrayName, line);
+            requireIndex(inferExpr(aa->index, line), line);
+            return StaticType::DYNAMIC; // arrays hold mixed elements
+        }
+        if (auto sl = dynamic_pointer_cast<SliceExpr>(expr)) {
+            requireArray(sl->arrayName, line);
+            if (sl->from) requireIndex(inferExpr(sl->from, line), line);
+            if (sl->to) requireIndex(inferExpr(sl->to, line), line);
+            return StaticType::ARRAY;
+        }
+        if (auto c = dynamic_pointer_cast<CallExpr>(expr)) {
+            for (auto& a : c->args) inferExpr(a, line);
+            return StaticType::DYNAMIC;
+        }
+        if (auto v = dynamic_pointer_cast<VarExpr>(expr)) {
+            StaticType t = varType(v->name);
+            if (t == StaticType::BOTTOM) error(line, "undefined variable '" + v->name + "'");
+            return t;
+        }
+        if (auto b = dynamic_pointer_cast<BinaryExpr>(expr)) {
+            int at = b->line ? b->line : line;
+            StaticType l = inferExpr(b->left, at);
+            StaticType r = inferExpr(b->right, at);
+            return inferBinary(*b, l, r, at);
+        }
+        return StaticType::DYNAMIC;
+    }
+
+    StaticType inferBinary(BinaryExpr& b, StaticType l, StaticType r, int line) {
+        if (l == StaticType::BOTTOM || r == StaticType::BOTTOM) return StaticType::BOTTOM;
+        const string& op = b.op;
+        bool known = l != StaticType::DYNAMIC && r != StaticType::DYNAMIC;
+
+        if (op == "+" && (l == StaticType::STR || r == StaticType::STR || isContainer(l) || isContainer(r))) {
+            prove(b, QuickKind::CONCAT);
+            return StaticType::STR;
+        }
+
+        if (op == "+" || op == "-" || op == "*" || op == "/") {
+            if (l == StaticType::STR || r == StaticType::STR || isContainer(l) || isContainer(r)) {
+                error(line, "operator '" + op + "' cannot be applied to " + typeName(l) + " and " + typeName(r));
+                return StaticType::DYNAMIC;
+            }
+            if (!known) return StaticType::DYNAMIC;
+            bool ints = l == StaticType::INT && r == StaticType::INT;
+            if (op == "+") prove(b, ints ? QuickKind::INT_ADD : QuickKind::NUM_ADD);
+            else if (op == "-") prove(b, ints ? QuickKind::INT_SUB : QuickKind::NUM_SUB);
+            else if (op == "*") prove(b, ints ? QuickKind::INT_MUL : QuickKind::NUM_MUL);
+            else prove(b, ints ? QuickKind::INT_DIV : QuickKind::NUM_DIV);
+            return ints ? StaticType::INT : StaticType::FLOAT;
+        }
+
+        // Comparisons always produce 1 or 0
+        if (isContainer(l) || isContainer(r) || (known && isNumeric(l) != isNumeric(r))) {
+            error(line, "cannot compare " + string(typeName(l)) + " with " + typeName(r) + " using '" + op + "'");
+            return StaticType::INT;
+        }
+        if (known) {
+            bool ints = l == StaticType::INT && r == StaticType::INT;
+            bool num = isNumeric(l);
+            if (op == "<") prove(b, ints ? QuickKind::INT_LT : num ? QuickKind::NUM_LT : QuickKind::STR_LT);
+            else if (op == ">") prove(b, ints ? QuickKind::INT_GT : num ? QuickKind::NUM_GT : QuickKind::STR_GT);
+            else if (op == "<=") prove(b, ints ? QuickKind::INT_LE : num ? QuickKind::NUM_LE : QuickKind::STR_LE);
+            else if (op == ">=") prove(b, ints ? QuickKind::INT_GE : num ? QuickKind::NUM_GE : QuickKind::STR_GE);
+            else if (op == "==") prove(b, ints ? QuickKind::INT_EQ : num ? QuickKind::NUM_EQ : QuickKind::STR_EQ);
+            else if (op == "!=") prove(b, ints ? QuickKind::INT_NE : num ? QuickKind::NUM_NE : QuickKind::STR_NE);
+        }
+        return StaticType::INT;
+    }
+
+    void prove(BinaryExpr& b, QuickKind kind) {
+        if (!reporting) return;
+        b.quick = kind;
+        b.proven = true;
+    }
+};
+
+/* =====================
+   INTERPRETER
+   - walks the AST
+   - keeps variables in memory
+   ===================== */
+
+// Runtime values: array elements are scalars, variables can also hold a whole array.
+// int variables are real 64-bit integers, float variables are doubles
+using Scalar = variant<int64_t, double, string>;
+
+// Hash table behind the map type. Open addressing with linear probing:
+// the hashes live in their own dense array so a probe sequence only touches
+// 8 bytes per slot, and deletion shifts entries back instead of leaving tombstones.
+class HashMap {
+    vector<uint64_t> hashes;            // 0 marks an empty slot
+    vector<pair<Scalar, Scalar>> slots; // key/value, parallel to hashes
+    size_t count = 0;
+
+public:
+    size_t size() const { return count; }
+    size_t tableBytes() const { return hashes.capacity() * sizeof(uint64_t) + slots.capacity() * sizeof(slots[0]); }
+
+    Scalar* find(const Scalar& key) {
+        if (count == 0) return nullptr;
+        size_t i = lookup(key, hashKey(key));
+        return hashes[i] ? &slots[i].second : nullptr;
+    }
+
+    bool contains(const Scalar& key) { return find(key) != nullptr; }
+
+    void insert(Scalar key, Scalar value) {
+        normalize(key);
+        if ((count + 1) * 10 > hashes.size() * 7) grow();
+        uint64_t h = hashKey(key);
+        size_t i = lookup(key, h);
+        if (!hashes[i]) {
+            hashes[i] = h;
+            slots[i].first = move(key);
+            count++;
+        }
+        slots[i].second = move(value);
+    }
+
+    bool erase(const Scalar& key) {
+        if (count == 0) return false;
+        size_t mask = hashes.size() - 1;
+        size_t hole = lookup(key, hashKey(key));
+        if (!hashes[hole]) return false;
+        hashes[hole] = 0;
+        slots[hole] = {};
+        count--;
+
+        // Backward-shift: pull later entries of the probe run into the hole
+        // unless their home slot lies cyclically between the hole and them
+        for (size_t j = (hole + 1) & mask; hashes[j]; j = (j + 1) & mask) {
+            size_t home = hashes[j] & mask;
+            bool stays = (hole <= j) ? (hole < home && home <= j) : (hole < home || home <= j);
+            if (stays) continue;
+            hashes[hole] = hashes[j];
+            slots[hole] = move(slots[j]);
+            hashes[j] = 0;
+            slots[j] = {};
+            hole = j;
+        }
+        return true;
+    }
+
+    template <typename F>
+    void forEach(F f) const {
+        for (size_t i = 0; i < hashes.size(); ++i) {
+            if (hashes[i]) f(slots[i].first, slots[i].second);
+        }
+    }
+
+private:
+    // Index of the slot holding key, or of the empty slot where it would go
+    size_t lookup(const Scalar& key, uint64_t h) const {
+        size_t mask = hashes.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask) {
+            if (!hashes[i] || (hashes[i] == h && sameKey(slots[i].first, key))) return i;
+        }
+    }
+
+    void grow() {
+        vector<uint64_t> oldHashes = move(hashes);
+        vector<pair<Scalar, Scalar>> oldSlots = move(slots);
+        size_t cap = oldHashes.empty() ? 16 : oldHashes.size() * 2;
+        hashes.assign(cap, 0);
+        slots.assign(cap, {});
+        for (size_t i = 0; i < oldHashes.size(); ++i) {
+            if (!oldHashes[i]) continue;
+            size_t j = oldHashes[i] & (cap - 1);
+            while (hashes[j]) j = (j + 1) & (cap - 1);
+            hashes[j] = oldHashes[i];
+            slots[j] = move(oldSlots[i]);
+        }
+    }
+
+    static bool integral(double d) {
+        return d == std::trunc(d) && d >= -9223372036854775808.0 && d < 9223372036854775808.0;
+    }
+
+    // Whole-number float keys are stored as ints, so 5 and 5.0 are the same key
+    static void normalize(Scalar& key) {
+        if (auto d = get_if<double>(&key)) {
+            if (integral(*d)) key = (int64_t)*d;
+        }
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    static uint64_t hashKey(const Scalar& key) {
+        uint64_t h;
+        if (auto i = get_if<int64_t>(&key)) {
+            h = mix((uint64_t)*i);
+        } else if (auto d = get_if<double>(&key)) {
+            if (integral(*d)) {
+                h = mix((uint64_t)(int64_t)*d);
+            } else if (*d != *d) {
+                h = mix(0x7ff8000000000000ULL); // every NaN is one key, whatever its payload
+            } else {
+                uint64_t bits;
+                memcpy(&bits, d, sizeof bits);
+                h = mix(bits);
+            }
+        } else {
+            h = mix(std::hash<string>{}(get<string>(key)) ^ 0x9e3779b97f4a7c15ULL);
+        }
+        return h ? h : 1;
+    }
+
+    static bool sameKey(const Scalar& a, const Scalar& b) {
+        bool aStr = holds_alternative<string>(a), bStr = holds_alternative<string>(b);
+        if (aStr || bStr) return aStr && bStr && get<string>(a) == get<string>(b);
+        if (holds_alternative<int64_t>(a) && holds_alternative<int64_t>(b)) return get<int64_t>(a) == get<int64_t>(b);
+        double x = holds_alternative<int64_t>(a) ? (double)get<int64_t>(a) : get<double>(a);
+        double y = holds_alternative<int64_t>(b) ? (double)get<int64_t>(b) : get<double>(b);
+        return x == y || (x != x && y != y);
+    }
+};
+
+// Dense numbers-only array, as loaded by readnum :
+using NumArray = vector<double>;
+
+// View of part of a general array made by arr[a:b]. Slicing moves the array into
+// shared storage, so the parent and its slices all read the same elements; the
+// first write to any of them while the storage is shared copies its own range
+struct ArraySlice {
+    shared_ptr<vector<Scalar>> base;
+    size_t begin = 0, end = 0;
+    const Scalar* data() const { return base->data() + begin; }
+    size_t size() const { return end - begin; }
+};
+
+// General array kept in memory-mapped temp files instead of the heap, for read :
+// results over --spill-limit. Elements are fixed 16-byte cells holding an int, a
+// double, or the offset and length of a string in a second file, the string heap.
+// The OS pages both files in and out. Copies share the files until one is written
+class SpillArray {
+    enum Tag : uint32_t { INT, NUM, STR };
+    struct Cell {
+        uint32_t tag;
+        uint32_t length; // of a string
+        uint64_t bits;   // int, double bits, or string offset in the heap
+    };
+
+    // One unlinked temp file, mapped shared and grown by doubling
+    struct Region {
+        int fd = -1;
+        char* data = nullptr;
+        size_t capacity = 0, used = 0;
+
+        Region() {
+#ifdef _WIN32
+            throw runtime_error("Spilling arrays to disk is not supported on Windows");
+#else
+            string name = (filesystem::path(directory.empty() ? filesystem::temp_directory_path().string() : directory) /
+                           "sprout-spill-XXXXXX").string();
+            fd = mkstemp(name.data());
+            if (fd < 0) throw runtime_error("Cannot create spill file in " + filesystem::path(name).parent_path().string());
+            unlink(name.c_str()); // gone as soon as it is closed, even after a crash
+#endif
+        }
+
+        ~Region() {
+#ifndef _WIN32
+            if (data) munmap(data, capacity);
+            if (fd >= 0) close(fd);
+#endif
+        }
+
+        Region(const Region&) = delete;
+        Region& operator=(const Region&) = delete;
+
+        char* reserve(size_t n) {
+#ifndef _WIN32
+            if (used + n > capacity) {
+                size_t grown = max({capacity * 2, used + n, (size_t)1 << 20});
+                if (ftruncate(fd, (off_t)grown) != 0) throw runtime_error("Cannot grow spill file: " + string(strerror(errno)));
+                void* mem = mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (mem == MAP_FAILED) throw runtime_error("Cannot map spill file: " + string(strerror(errno)));
+                if (data) munmap(data, capacity);
+                data = (char*)mem;
+                capacity = grown;
+            }
+#endif
+            return data + used;
+        }
+
+        // Sequential: read ahead aggressively and drop pages once passed
+        void advise(bool sequential) {
+#ifndef _WIN32
+            if (data) madvise(data, capacity, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+#endif
+        }
+    };
+
+    struct Storage {
+        Region cells, heap;
+        size_t count = 0;
+        size_t next = 0, run = 0; // access pattern, for read-ahead hints
+        bool sequential = false;
+    };
+    shared_ptr<Storage> store;
+
+    // Consecutive reads before the files are marked for sequential read-ahead
+    static constexpr size_t SEQUENTIAL_RUN = 64;
+
+    Cell& cell(size_t i) const { return reinterpret_cast<Cell*>(store->cells.data)[i]; }
+
+    Scalar element(size_t i) const {
+        const Cell& c = cell(i);
+        if (c.tag == INT) return (int64_t)c.bits;
+        if (c.tag == NUM) {
+            double d;
+            memcpy(&d, &c.bits, sizeof d);
+            return d;
+        }
+        return string(store->heap.data + c.bits, c.length);
+    }
+
+    // Hint that the array is being read front to back
+    void walk() const {
+        store->cells.advise(true);
+        store->heap.advise(true);
+        store->sequential = true;
+    }
+
+    Cell encode(const Scalar& v) {
+        Cell c{};
+        if (auto i = get_if<int64_t>(&v)) {
+            c.tag = INT;
+            c.bits = (uint64_t)*i;
+        } else if (auto d = get_if<double>(&v)) {
+            c.tag = NUM;
+            memcpy(&c.bits, d, sizeof c.bits);
+        } else {
+            const string& s = get<string>(v);
+            if (s.size() > UINT32_MAX) throw runtime_error("String too long for a spilled array");
+            c.tag = STR;
+            c.length = (uint32_t)s.size();
+            c.bits = store->heap.used;
+            memcpy(store->heap.reserve(s.size()), s.data(), s.size());
+            store->heap.used += s.size();
+        }
+        return c;
+    }
+
+    // Gives this array files of its own before a write, if they are shared
+    void own() {
+        if (store.use_count() == 1) return;
+        auto copy = make_shared<Storage>();
+        memcpy(copy->cells.reserve(store->cells.used), store->cells.data, store->cells.used);
+        copy->cells.used = store->cells.used;
+        memcpy(copy->heap.reserve(store->heap.used), store->heap.data, store->heap.used);
+        copy->heap.used = store->heap.used;
+        copy->count = store->count;
+        store = move(copy);
+    }
+
+public:
+    static inline size_t limit = 0;      // bytes an array may take in memory; 0 = never spill
+    static inline string directory;      // for the spill files; empty = system temp directory
+
+    SpillArray() : store(make_shared<Storage>()) {}
+
+    size_t size() const { return store->count; }
+
+    Scalar at(size_t i) const {
+        Storage& s = *store;
+        if (i == s.next) {
+            if (++s.run == SEQUENTIAL_RUN) walk();
+        } else if (s.sequential) {
+            s.cells.advise(false);
+            s.heap.advise(false);
+            s.sequential = false;
+            s.run = 0;
+        } else {
+            s.run = 0;
+        }
+        s.next = i + 1;
+        return element(i);
+    }
+
+    // Reads every element in order without touching the access pattern, so a
+    // background write can walk a snapshot while the script keeps using the array
+    template <typename F>
+    void forEach(F visit) const {
+        store->cells.advise(true);
+        store->heap.advise(true);
+        for (size_t i = 0; i < store->count; ++i) visit(element(i));
+        store->cells.advise(false);
+        store->heap.advise(false);
+    }
+
+    // A replaced string stays in the heap unused; the heap is not compacted
+    void set(size_t i, const Scalar& v) {
+        own();
+        Cell c = encode(v);
+        cell(i) = c;
+    }
+
+    void push_back(const Scalar& v) {
+        own();
+        Cell c = encode(v);
+        memcpy(store->cells.reserve(sizeof c), &c, sizeof c);
+        store->cells.used += sizeof c;
+        store->count++;
+    }
+};
+
+using Value = variant<int64_t, double, string, vector<Scalar>, HashMap, NumArray, ArraySlice, SpillArray>;
+
+// Read-only elements of a general array or a slice
+struct ScalarSpan {
+    const Scalar* ptr = nullptr;
+    size_t count = 0;
+    const Scalar* begin() const { return ptr; }
+    const Scalar* end() const { return ptr + count; }
+    size_t size() const { return count; }
+    const Scalar& operator[](size_t i) const { return ptr[i]; }
+};
+
+static bool isScalarArray(const Value& v) {
+    return holds_alternative<vector<Scalar>>(v) || holds_alternative<ArraySlice>(v);
+}
+
+// Only valid while isScalarArray(v)
+static ScalarSpan scalarsOf(const Value& v) {
+    if (auto s = get_if<ArraySlice>(&v)) return {s->data(), s->size()};
+    auto& arr = get<vector<Scalar>>(v);
+    return {arr.data(), arr.size()};
+}
+
+// Makes v an array of its own before it is modified, copying only if the storage is shared.
+// A spilled array is loaded back into memory
+static vector<Scalar>& ownArray(Value& v) {
+    if (auto sp = get_if<SpillArray>(&v)) {
+        vector<Scalar> own;
+        own.reserve(sp->size());
+        sp->forEach([&own](Scalar s) { own.push_back(move(s)); });
+        v = move(own);
+    } else if (auto s = get_if<ArraySlice>(&v)) {
+        vector<Scalar> own;
+        if (s->base.use_count() == 1) {
+            own = move(*s->base);
+            own.erase(own.begin() + s->end, own.end());
+            own.erase(own.begin(), own.begin() + s->begin);
+        } else {
+            own.assign(s->data(), s->data() + s->size());
+        }
+        v = move(own);
+    }
+    return get<vector<Scalar>>(v);
+}
+
+// Bump allocator for statement-local temporaries such as concatenation
+// buffers. Memory comes from large blocks that are kept for reuse; each
+// statement rewinds to where it started, so steady-state loops allocate
+// nothing from the heap. Values that outlive the statement are copied out.
+class Arena : public pmr::memory_resource {
+    struct Block {
+        unique_ptr<char[]> data;
+        size_t size;
+    };
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    vector<Block> blocks;
+    size_t block = 0;  // block being filled
+    size_t offset = 0; // fill level of that block
+    size_t below = 0;  // bytes in the blocks before it
+
+public:
+    struct Stats {
+        size_t allocations = 0, bytes = 0, peak = 0, statements = 0;
+    };
+    Stats stats;
+
+    // Rewinds the arena when the enclosing statement finishes, even by exception
+    class Scope {
+        Arena& arena;
+        size_t block, offset, below;
+
+    public:
+        explicit Scope(Arena& a) : arena(a), block(a.block), offset(a.offset), below(a.below) {}
+        ~Scope() {
+            arena.block = block;
+            arena.offset = offset;
+            arena.below = below;
+            arena.stats.statements++;
+        }
+    };
+
+    size_t reserved() const {
+        size_t total = 0;
+        for (auto& b : blocks) total += b.size;
+        return total;
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+
+protected:
+    void* do_allocate(size_t n, size_t align) override {
+        while (true) {
+            if (block == blocks.size()) {
+                size_t size = max(BLOCK_SIZE, n + align);
+                blocks.push_back({make_unique<char[]>(size), size});
+            }
+            Block& b = blocks[block];
+            size_t start = (offset + align - 1) & ~(align - 1);
+            if (start + n <= b.size) {
+                offset = start + n;
+                stats.allocations++;
+                stats.bytes += n;
+                stats.peak = max(stats.peak, below + offset);
+                return b.data.get() + start;
+            }
+            below += b.size;
+            block++;
+            offset = 0;
+        }
+    }
+
+    void do_deallocate(void* p, size_t n, size_t) override {
+        // Only the newest allocation can be handed back; the rest waits for the rewind
+        if (block < blocks.size() && (char*)p + n == blocks[block].data.get() + offset) offset -= n;
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+/* =====================
+   COMPRESSED FILES
+   - read : and each : recognise gzip and zstd files by their first bytes
+     and decompress them on a helper thread while lines are consumed
+   - write : compresses when the file name ends in .gz or .zst
+   gzip needs zlib (link with -lz), zstd needs libzstd (-lzstd); a build
+   without one reports files in that format instead of reading garbage
+   ===================== */
+enum class Codec { NONE, GZIP, ZSTD };
+
+static Codec codecOfMagic(const unsigned char* p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return Codec::GZIP;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return Codec::ZSTD;
+    return Codec::NONE;
+}
+
+static Codec codecOfName(const string& fileName) {
+    auto endsWith = [&fileName](const char* ext) {
+        size_t n = strlen(ext);
+        return fileName.size() > n && fileName.compare(fileName.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".gz")) return Codec::GZIP;
+    if (endsWith(".zst")) return Codec::ZSTD;
+    return Codec::NONE;
+}
+
+// Peeks at the first bytes of an open file and rewinds it
+// Pipes, FIFOs and devices cannot be rewound, so only regular files are sniffed
+static bool isRegularFile(FILE* file) {
+#ifdef _WIN32
+    struct _stat st;
+    return _fstat(_fileno(file), &st) == 0 && (st.st_mode & _S_IFREG);
+#else
+    struct stat st;
+    return fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+static Codec sniffCodec(FILE* file) {
+    if (!isRegularFile(file)) return Codec::NONE; // only plain text from a pipe
+    unsigned char magic[4];
+    size_t n = fread(magic, 1, sizeof magic, file);
+    if (fseek(file, 0, SEEK_SET) != 0) return Codec::NONE;
+    return codecOfMagic(magic, n);
+}
+
+static void requireCodec(Codec codec, const string& fileName) {
+#ifndef SPROUT_HAVE_ZLIB
+    if (codec == Codec::GZIP) throw runtime_error(fileName + " is gzip-compressed, but this build has no zlib support");
+#endif
+#ifndef SPROUT_HAVE_ZSTD
+    if (codec == Codec::ZSTD) throw runtime_error(fileName + " is zstd-compressed, but this build has no zstd support");
+#endif
+    (void)codec;
+    (void)fileName;
+}
+
+// Decompresses a file on a helper thread that stays a few buffers ahead of
+// the reader, so inflating overlaps with splitting and storing the lines
+class Decompressor {
+    static constexpr size_t CHUNK = 1 << 20;
+    static constexpr size_t DEPTH = 4; // decompressed buffers waiting for the reader
+
+    FILE* file;
+    Codec codec;
+    string fileName;
+
+    mutex mtx;
+    condition_variable cv;
+    deque<vector<char>> ready;
+    vector<vector<char>> spare; // consumed buffers, handed back for reuse
+    bool finished = false, stopping = false;
+    string error;
+
+    vector<char> current; // being read by the consumer
+    size_t pos = 0;
+    thread worker;
+
+public:
+    // Takes ownership of file
+    Decompressor(FILE* f, Codec c, string name) : file(f), codec(c), fileName(move(name)) {
+        try {
+            requireCodec(codec, fileName);
+        } catch (...) {
+            fclose(file);
+            throw;
+        }
+        worker = thread([this] { run(); });
+    }
+
+    ~Decompressor() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+        fclose(file);
+    }
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    // Like fread: fills out with up to n bytes, returns 0 at the end of the data
+    size_t read(char* out, size_t n) {
+        size_t done = 0;
+        while (done < n) {
+            if (pos == current.size()) {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [this] { return !ready.empty() || finished; });
+                if (ready.empty()) {
+                    if (!error.empty() && done == 0) throw runtime_error(error);
+                    break;
+                }
+                spare.push_back(move(current));
+                current = move(ready.front());
+                ready.pop_front();
+                pos = 0;
+                cv.notify_all();
+            }
+            size_t take = min(n - done, current.size() - pos);
+            memcpy(out + done, current.data() + pos, take);
+            pos += take;
+            done += take;
+        }
+        return done;
+    }
+
+private:
+    void run() {
+        try {
+            if (codec == Codec::GZIP) inflateGzip();
+            else inflateZstd();
+        } catch (const exception& e) {
+            lock_guard<mutex> lock(mtx);
+            error = e.what();
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            finished = true;
+        }
+        cv.notify_all();
+    }
+
+    vector<char> buffer() {
+        lock_guard<mutex> lock(mtx);
+        if (spare.empty()) return vector<char>(CHUNK);
+        vector<char> b = move(spare.back());
+        spare.pop_back();
+        b.resize(CHUNK);
+        return b;
+    }
+
+    // Queues used bytes of out for the reader; false once the reader has gone away
+    bool emit(vector<char>& out, size_t used) {
+        out.resize(used);
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this] { return ready.size() < DEPTH || stopping; });
+        if (stopping) return false;
+        ready.push_back(move(out));
+        cv.notify_all();
+        return true;
+    }
+
+    size_t fill(vector<char>& in) { return fread(in.data(), 1, in.size(), file); }
+
+    void inflateGzip() {
+#ifdef SPROUT_HAVE_ZLIB
+        z_stream z{};
+        if (inflateInit2(&z, 15 + 32) != Z_OK) throw runtime_error("Cannot start gzip decoder");
+        unique_ptr<z_stream, int (*)(z_stream*)> guard(&z, inflateEnd);
+        vector<char> in(CHUNK), out = buffer();
+        size_t used = 0;
+        bool ended = false;
+        while (true) {
+            if (z.avail_in == 0) {
+                size_t n = fill(in);
+                if (n == 0) break;
+                z.next_in = (Bytef*)in.data();
+                z.avail_in = (uInt)n;
+            }
+            if (ended) { // concatenated gzip members, as written by gzip -c a b
+                inflateReset(&z);
+                ended = false;
+            }
+            z.next_out = (Bytef*)out.data() + used;
+            z.avail_out = (uInt)(out.size() - used);
+            int rc = inflate(&z, Z_NO_FLUSH);
+            used = out.size() - z.avail_out;
+            if (rc == Z_STREAM_END) ended = true;
+            else if (rc != Z_OK && rc != Z_BUF_ERROR) throw runtime_error("Corrupt gzip data in " + fileName);
+            if (used == out.size()) {
+                if (!emit(out, used)) return;
+                out = buffer();
+                used = 0;
+            }
+        }
+        if (!ended) throw runtime_error("Truncated gzip file " + fileName);
+        if (used > 0) emit(out, used);
+#endif
+    }
+
+    void inflateZstd() {
+#ifdef SPROUT_HAVE_ZSTD
+        unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        if (!ctx) throw runtime_error("Cannot start zstd decoder");
+        vector<char> in(CHUNK), out = buffer();
+        ZSTD_inBuffer input{in.data(), 0, 0};
+        size_t used = 0, pending = 0; // pending != 0: the last frame is incomplete
+        bool full = false;            // the last call filled out, so zstd may still hold decoded bytes
+        while (true) {
+            if (input.pos == input.size) {
+                size_t n = fill(in);
+                // Out of input: an unfinished frame that filled out is flushed with
+                // empty input until a call leaves room, then pending tells the truth
+                if (n == 0 && (!full || pending == 0)) break;
+                input = {in.data(), n, 0};
+            }
+            ZSTD_outBuffer output{out.data(), out.size(), used};
+            pending = ZSTD_decompressStream(ctx.get(), &output, &input);
+            if (ZSTD_isError(pending)) {
+                throw runtime_error("Corrupt zstd data in " + fileName + ": " + ZSTD_getErrorName(pending));
+            }
+            used = output.pos;
+            full = used == out.size();
+            if (full) {
+                if (!emit(out, used)) return;
+                out = buffer();
+                used = 0;
+            }
+        }
+        if (pending != 0) throw runtime_error("Truncated zstd file " + fileName);
+        if (used > 0) emit(out, used);
+#endif
+    }
+};
+
+// Output stream buffer that compresses into a file as it fills.
+// finish() must be called to end the stream; errors are thrown from there
+class CompressOutBuf : public streambuf {
+    static constexpr size_t CHUNK = 1 << 20;
+
+    FILE* file = nullptr;
+    Codec codec;
+    string fileName;
+    vector<char> buf, out;
+#ifdef SPROUT_HAVE_ZLIB
+    z_stream z{};
+#endif
+#ifdef SPROUT_HAVE_ZSTD
+    ZSTD_CCtx* cctx = nullptr;
+#endif
+
+public:
+    CompressOutBuf(const string& name, Codec c) : codec(c), fileName(name), buf(CHUNK), out(CHUNK) {
+        requireCodec(codec, fileName);
+#ifdef SPROUT_HAVE_ZLIB
+        if (codec == Codec::GZIP && deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw runtime_error("Cannot start gzip encoder");
+        }
+#endif
+#ifdef SPROUT_HAVE_ZSTD
+        if (codec == Codec::ZSTD && !(cctx = ZSTD_createCCtx())) throw runtime_error("Cannot start zstd encoder");
+#endif
+        file = fopen(fileName.c_str(), "wb");
+        if (!file) {
+            release();
+            throw runtime_error("Cannot open file " + fileName);
+        }
+        setp(buf.data(), buf.data() + buf.size());
+    }
+
+    ~CompressOutBuf() override {
+        release();
+        if (file) fclose(file); // finish() was not reached: the file is left incomplete
+    }
+
+    void finish() {
+        compress(true);
+        FILE* f = file;
+        file = nullptr;
+        if (fclose(f) != 0) throw runtime_error("Cannot write file " + fileName);
+    }
+
+protected:
+    int overflow(int c) override {
+        compress(false);
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char* s, streamsize n) override {
+        streamsize done = 0;
+        while (done < n) {
+            if (pptr() == epptr()) compress(false);
+            streamsize take = min(n - done, (streamsize)(epptr() - pptr()));
+            memcpy(pptr(), s + done, (size_t)take);
+            pbump((int)take);
+            done += take;
+        }
+        return n;
+    }
+
+private:
+    void release() {
+#ifdef SPROUT_HAVE_ZLIB
+        if (codec == Codec::GZIP) deflateEnd(&z);
+#endif
+#ifdef SPROUT_HAVE_ZSTD
+        if (cctx) ZSTD_freeCCtx(cctx);
+        cctx = nullptr;
+#endif
+    }
+
+    void put(size_t n) {
+        if (n > 0 && fwrite(out.data(), 1, n, file) != n) throw runtime_error("Cannot write file " + fileName);
+    }
+
+    // Compresses the buffered bytes; end also flushes the encoder and closes the stream
+    void compress(bool end) {
+        size_t n = pptr() - pbase();
+        setp(buf.data(), buf.data() + buf.size());
+#ifdef SPROUT_HAVE_ZLIB
+        if (codec == Codec::GZIP) {
+            z.next_in = (Bytef*)buf.data();
+            z.avail_in = (uInt)n;
+            do {
+                z.next_out = (Bytef*)out.data();
+                z.avail_out = (uInt)out.size();
+                if (deflate(&z, end ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) {
+                    throw runtime_error("gzip encoder failed on " + fileName);
+                }
+                put(out.size() - z.avail_out);
+            } while (z.avail_out == 0);
+        }
+#endif
+#ifdef SPROUT_HAVE_ZSTD
+        if (codec == Codec::ZSTD) {
+            ZSTD_inBuffer input{buf.data(), n, 0};
+            size_t left;
+            do {
+                ZSTD_outBuffer output{out.data(), out.size(), 0};
+                left = ZSTD_compressStream2(cctx, &output, &input, end ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(left)) {
+                    throw runtime_error("zstd encoder failed on " + fileName + ": " + ZSTD_getErrorName(left));
+                }
+                put(output.pos);
+            } while (end ? left != 0 : input.pos < input.size);
+        }
+#endif
+        (void)n;
+        (void)end;
+    }
+};
+
+// Line-at-a-time reader for each : statements. Input goes through one fixed
+// read-ahead buffer, so memory stays bounded whatever the size of the file,
+// and the first line is available as soon as the first buffer is filled.
+class LineReader {
+    FILE* file = nullptr;
+    istream* stream = nullptr; // "-" reads the interpreter's input stream instead of a file
+    unique_ptr<Decompressor> inflater; // for a compressed file, which it owns
+    vector<char> buffer;
+    size_t start = 0, end = 0; // unread bytes are buffer[start, end)
+    bool eof = false;
+
+public:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    LineReader(const string& fileName, istream& stdinStream) : buffer(BUFFER_SIZE) {
+        if (fileName == "-" && &stdinStream == &cin) {
+            file = stdin; // fread is much faster than going through cin
+        } else if (fileName == "-") {
+            stream = &stdinStream;
+        } else {
+            open(fileName);
+        }
+    }
+
+    // A file only, for read :
+    explicit LineReader(const string& fileName) : buffer(BUFFER_SIZE) { open(fileName); }
+
+    ~LineReader() {
+        if (file && file != stdin) fclose(file);
+    }
+
+    LineReader(const LineReader&) = delete;
+    LineReader& operator=(const LineReader&) = delete;
+
+    // Same line splitting as getline: the final line needs no trailing newline
+    bool next(string& line) {
+        line.clear();
+        while (true) {
+            const char* begin = buffer.data() + start;
+            const char* nl = static_cast<const char*>(memchr(begin, '\n', end - start));
+            if (nl) {
+                line.append(begin, nl);
+                start = nl - buffer.data() + 1;
+                return true;
+            }
+            line.append(begin, end - start); // partial line, continue with the next chunk
+            start = end = 0;
+            if (eof) return !line.empty();
+            end = inflater ? inflater->read(buffer.data(), buffer.size())
+                  : file   ? fread(buffer.data(), 1, buffer.size(), file)
+                           : refill();
+            if (end == 0) {
+                eof = true;
+                return !line.empty();
+            }
+        }
+    }
+
+private:
+    void open(const string& fileName) {
+        file = fopen(fileName.c_str(), "rb");
+        if (!file) throw runtime_error("Cannot open file " + fileName);
+        if (Codec codec = sniffCodec(file); codec != Codec::NONE) {
+            FILE* compressed = file;
+            file = nullptr;
+            inflater = make_unique<Decompressor>(compressed, codec, fileName);
+        }
+    }
+
+    // Take whatever the stream has ready (up to a full buffer) so a pipe or
+    // terminal does not have to fill the whole buffer before lines come out
+    size_t refill() {
+        size_t n = (size_t)stream->readsome(buffer.data(), buffer.size());
+        if (n > 0) return n;
+        stream->read(buffer.data(), 1); // nothing buffered: block for at least one byte
+        n = (size_t)stream->gcount();
+        if (n == 0) return 0;
+        return n + (size_t)stream->readsome(buffer.data() + 1, buffer.size() - 1);
+    }
+};
+
+/* =====================
+   ARRAY FILES
+   write : to a name ending in .sparr saves an array in binary; read : and
+   readnum : load files with that extension back exactly.
+   Layout, all integers little-endian:
+     0  "SPRA"   4  u32 version   8  u32 kind (0 = doubles, 1 = tagged)   12 u32 0
+     16 u64 element count   24 u64 string table bytes   32 u64 checksum of the rest
+     40 kind 0: the doubles
+        kind 1: one tag byte per element (0 int, 1 double, 2 string), zero padded
+                to 8 bytes, one 8-byte value per element (a string's value is its
+                offset in the table), then the table of u32-length-prefixed strings
+   ===================== */
+static constexpr uint32_t ARRAY_FILE_VERSION = 1;
+static constexpr size_t ARRAY_FILE_HEADER = 40;
+
+static uint64_t toLittleEndian(uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(v);
+#else
+    return v;
+#endif
+}
+
+static uint64_t readLE64(const void* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return toLittleEndian(v);
+}
+
+static uint32_t readLE32(const void* p) {
+    auto b = static_cast<const unsigned char*>(p);
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+// 64-bit checksum built on xxHash64's round function: four independent lanes
+// over 32-byte stripes, so checking a file costs far less than reading it
+class Checksum {
+    static constexpr uint64_t P1 = 11400714785074694791ull, P2 = 14029467366897019727ull,
+                              P3 = 1609587929392839161ull, P4 = 9650029242287828579ull,
+                              P5 = 2870177450012600261ull;
+    uint64_t lanes[4] = {P1 + P2, P2, 0, 0 - P1};
+    unsigned char pending[32];
+    size_t pendingLen = 0;
+    uint64_t total = 0;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+
+    void stripe(const unsigned char* p) {
+        for (int i = 0; i < 4; ++i) lanes[i] = round(lanes[i], readLE64(p + 8 * i));
+    }
+
+public:
+    void update(const void* data, size_t n) {
+        auto p = static_cast<const unsigned char*>(data);
+        total += n;
+        if (pendingLen > 0) {
+            size_t take = min(n, sizeof pending - pendingLen);
+            memcpy(pending + pendingLen, p, take);
+            pendingLen += take;
+            p += take;
+            n -= take;
+            if (pendingLen < sizeof pending) return;
+            stripe(pending);
+            pendingLen = 0;
+        }
+        for (; n >= 32; p += 32, n -= 32) stripe(p);
+        memcpy(pending, p, n);
+        pendingLen = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18);
+        h ^= total * P5;
+        size_t i = 0;
+        for (; i + 8 <= pendingLen; i += 8) h = rotl(h ^ round(0, readLE64(pending + i)), 27) * P1 + P4;
+        for (; i < pendingLen; ++i) h = rotl(h ^ (pending[i] * P5), 11) * P1;
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+};
+
+// Read-only view of a whole file: mapped where mmap exists, read into memory elsewhere
+class FileView {
+    const char* ptr = nullptr;
+    size_t len = 0;
+    string copy;
+
+public:
+    explicit FileView(const string& fileName) {
+#ifndef _WIN32
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Cannot open file " + fileName);
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size > 0) {
+#ifdef MAP_POPULATE
+            int flags = MAP_PRIVATE | MAP_POPULATE; // fault the whole file in with one call
+#else
+            int flags = MAP_PRIVATE;
+#endif
+            void* mem = mmap(nullptr, (size_t)size, PROT_READ, flags, fd, 0);
+            if (mem != MAP_FAILED) {
+                madvise(mem, (size_t)size, MADV_SEQUENTIAL);
+                ptr = (const char*)mem;
+                len = (size_t)size;
+            }
+        }
+        close(fd);
+        if (ptr || size == 0) return;
+#endif
+        ifstream in(fileName, ios::binary);
+        if (!in) throw runtime_error("Cannot open file " + fileName);
+        stringstream buffer;
+        buffer << in.rdbuf();
+        copy = buffer.str();
+        ptr = copy.data();
+        len = copy.size();
+    }
+
+    ~FileView() {
+#ifndef _WIN32
+        if (ptr && ptr != copy.data()) munmap((void*)ptr, len);
+#endif
+    }
+
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+};
+
+// Array files are recognised by name, the rule write : uses, never by sniffing:
+// a text file may start with "SPRA", and a pipe would lose the bytes read
+static bool isArrayFile(const string& fileName) {
+    return fileName.size() > 6 && fileName.compare(fileName.size() - 6, 6, ".sparr") == 0;
+}
+
+// Buffers output for writeArrayFile and checksums everything after the header
+class ArrayFileWriter {
+    FILE* file;
+    string fileName;
+    vector<char> buf;
+    Checksum sum;
+
+public:
+    explicit ArrayFileWriter(const string& name) : fileName(name) {
+        file = fopen(fileName.c_str(), "wb");
+        if (!file) throw runtime_error("Cannot open file " + fileName);
+        buf.reserve(1 << 20);
+        buf.resize(ARRAY_FILE_HEADER); // filled in by finish
+    }
+
+    ~ArrayFileWriter() {
+        if (file) fclose(file);
+    }
+
+    void put(const void* data, size_t n) {
+        if (buf.size() + n > buf.capacity()) flush();
+        if (n >= buf.capacity()) {
+            sum.update(data, n);
+            write(data, n);
+            return;
+        }
+        auto p = static_cast<const char*>(data);
+        buf.insert(buf.end(), p, p + n);
+    }
+
+    void put64(uint64_t v) {
+        v = toLittleEndian(v);
+        put(&v, sizeof v);
+    }
+
+    void finish(uint32_t kind, uint64_t count, uint64_t tableBytes) {
+        flush();
+        char header[ARRAY_FILE_HEADER] = {'S', 'P', 'R', 'A'};
+        uint32_t fields[3] = {ARRAY_FILE_VERSION, kind, 0};
+        for (int i = 0; i < 3; ++i) {
+            for (int b = 0; b < 4; ++b) header[4 + 4 * i + b] = (char)(fields[i] >> (8 * b));
+        }
+        uint64_t tail[3] = {toLittleEndian(count), toLittleEndian(tableBytes), toLittleEndian(sum.digest())};
+        memcpy(header + 16, tail, sizeof tail);
+        if (fseek(file, 0, SEEK_SET) != 0) throw runtime_error("Cannot write file " + fileName);
+        write(header, sizeof header);
+        FILE* f = file;
+        file = nullptr;
+        if (fclose(f) != 0) throw runtime_error("Cannot write file " + fileName);
+    }
+
+private:
+    void write(const void* data, size_t n) {
+        if (fwrite(data, 1, n, file) != n) throw runtime_error("Cannot write file " + fileName);
+    }
+
+    void flush() {
+        size_t skip = ftell(file) == 0 ? ARRAY_FILE_HEADER : 0; // the placeholder header is not checksummed
+        sum.update(buf.data() + skip, buf.size() - skip);
+        write(buf.data(), buf.size());
+        buf.clear();
+    }
+};
+
+static void writeArrayFile(const string& fileName, const Value& val) {
+    ArrayFileWriter out(fileName);
+    if (auto nums = get_if<NumArray>(&val)) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (double d : *nums) {
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof bits);
+            out.put64(bits);
+        }
+#else
+        out.put(nums->data(), nums->size() * sizeof(double));
+#endif
+        out.finish(0, nums->size(), 0);
+        return;
+    }
+
+    // Tags, then values, then the string table: three passes over the elements
+    auto each = [&val](auto visit) {
+        if (auto spilled = get_if<SpillArray>(&val)) spilled->forEach(visit);
+        else if (isScalarArray(val)) for (auto& s : scalarsOf(val)) visit(s);
+        else throw runtime_error("Only arrays can be saved in binary");
+    };
+    uint64_t count = 0;
+    each([&](const Scalar& s) {
+        uint8_t tag = (uint8_t)s.index();
+        out.put(&tag, 1);
+        count++;
+    });
+    uint64_t zeros = 0;
+    out.put(&zeros, (8 - count % 8) % 8);
+    uint64_t table = 0;
+    each([&](const Scalar& s) {
+        if (auto i = get_if<int64_t>(&s)) {
+            out.put64((uint64_t)*i);
+        } else if (auto d = get_if<double>(&s)) {
+            uint64_t bits;
+            memcpy(&bits, d, sizeof bits);
+            out.put64(bits);
+        } else {
+            const string& text = get<string>(s);
+            if (text.size() > UINT32_MAX) throw runtime_error("String too long for an array file");
+            out.put64(table);
+            table += 4 + text.size();
+        }
+    });
+    each([&](const Scalar& s) {
+        if (auto text = get_if<string>(&s)) {
+            uint32_t n = (uint32_t)text->size();
+            unsigned char len[4] = {(unsigned char)n, (unsigned char)(n >> 8), (unsigned char)(n >> 16), (unsigned char)(n >> 24)};
+            out.put(len, 4);
+            out.put(text->data(), text->size());
+        }
+    });
+    out.finish(1, count, table);
+}
+
+// numeric (readnum :) wants a dense number array; tagged files of numbers convert to one
+static Value loadArrayFile(const string& fileName, bool numeric) {
+    FileView file(fileName);
+    const char* p = file.data();
+    auto corrupt = [&fileName](const string& why) { return runtime_error("Damaged array file " + fileName + ": " + why); };
+    if (file.size() < ARRAY_FILE_HEADER) throw corrupt("truncated header");
+    uint32_t version = readLE32(p + 4), kind = readLE32(p + 8);
+    uint64_t count = readLE64(p + 16), table = readLE64(p + 24), checksum = readLE64(p + 32);
+    if (version != ARRAY_FILE_VERSION) {
+        throw runtime_error("Array file " + fileName + " has format version " + to_string(version) +
+                            ", this interpreter reads version " + to_string(ARRAY_FILE_VERSION));
+    }
+    const char* body = p + ARRAY_FILE_HEADER;
+    size_t bodySize = file.size() - ARRAY_FILE_HEADER;
+    size_t tagBytes = (count + 7) / 8 * 8;
+    if (count > bodySize / 8 || table > bodySize ||
+        bodySize != (kind == 0 ? count * 8 : kind == 1 ? tagBytes + count * 8 + table : SIZE_MAX)) {
+        throw corrupt("size does not match its header");
+    }
+    Checksum sum;
+    sum.update(body, bodySize);
+    if (sum.digest() != checksum) throw corrupt("checksum mismatch");
+
+    if (kind == 0) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        NumArray nums(count);
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t bits = readLE64(body + 8 * i);
+            memcpy(&nums[i], &bits, sizeof bits);
+        }
+        return nums;
+#else
+        auto doubles = reinterpret_cast<const double*>(body); // 8-aligned: the mapping is page-aligned
+        return NumArray(doubles, doubles + count);
+#endif
+    }
+
+    const char* tags = body;
+    const char* values = body + tagBytes;
+    const char* strings = values + count * 8;
+    auto element = [&](size_t i) -> Scalar {
+        uint64_t v = readLE64(values + 8 * i);
+        switch (tags[i]) {
+        case 0:
+            return (int64_t)v;
+        case 1: {
+            double d;
+            memcpy(&d, &v, sizeof d);
+            return d;
+        }
+        case 2: {
+            if (v > table || table - v < 4) throw corrupt("string offset out of range");
+            uint32_t n = readLE32(strings + v);
+            if (n > table - v - 4) throw corrupt("string length out of range");
+            return string(strings + v + 4, n);
+        }
+        default:
+            throw corrupt("unknown element tag " + to_string((int)(unsigned char)tags[i]));
+        }
+    };
+
+    if (numeric) {
+        NumArray nums(count);
+        for (size_t i = 0; i < count; ++i) {
+            Scalar s = element(i);
+            if (holds_alternative<string>(s)) {
+                throw runtime_error("readnum : " + fileName + " holds a string at index " + to_string(i));
+            }
+            nums[i] = holds_alternative<int64_t>(s) ? (double)get<int64_t>(s) : get<double>(s);
+        }
+        return nums;
+    }
+    if (SpillArray::limit && count * sizeof(Scalar) + table > SpillArray::limit) {
+        SpillArray spilled;
+        for (size_t i = 0; i < count; ++i) spilled.push_back(element(i));
+        return spilled;
+    }
+    vector<Scalar> arr;
+    arr.reserve(count);
+    for (size_t i = 0; i < count; ++i) arr.push_back(element(i));
+    return arr;
+}
+
+/* =====================
+   FILE CACHE
+   - read : keeps the lines of every file it loads and hands them to later
+     reads of the same unchanged file (same path, inode, size and mtime)
+   - one cache serves all interpreters and threads in the process. Lines go
+     out as a slice of the cached array, so the first write to the variable
+     copies it and the cached lines never change
+   - least recently used files are dropped past --file-cache bytes; 0 turns
+     the cache off
+   ===================== */
+class FileCache {
+    struct Stamp {
+        uint64_t device = 0, inode = 0;
+        uintmax_t size = 0;
+        filesystem::file_time_type mtime;
+        bool operator==(const Stamp& o) const {
+            return device == o.device && inode == o.inode && size == o.size && mtime == o.mtime;
+        }
+    };
+    struct Entry {
+        Stamp stamp;
+        shared_ptr<vector<Scalar>> lines;
+        size_t bytes;
+        list<string>::iterator recent; // position in the LRU order
+    };
+
+    mutex mtx;
+    unordered_map<string, Entry> entries;
+    list<string> order; // most recently used first
+    size_t bytes = 0;
+
+    // Only regular files are cached; a pipe or device gives new data on every read
+    static bool stampOf(const string& fileName, Stamp& stamp) {
+        error_code ec;
+        stamp.mtime = filesystem::last_write_time(fileName, ec);
+        if (ec) return false;
+#ifndef _WIN32
+        struct stat st;
+        if (stat(fileName.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        stamp.device = (uint64_t)st.st_dev;
+        stamp.inode = (uint64_t)st.st_ino;
+        stamp.size = (uintmax_t)st.st_size;
+#else
+        if (!filesystem::is_regular_file(fileName, ec)) return false;
+        stamp.size = filesystem::file_size(fileName, ec);
+        if (ec) return false;
+#endif
+        return true;
+    }
+
+    void drop(unordered_map<string, Entry>::iterator it) {
+        bytes -= it->second.bytes;
+        order.erase(it->second.recent);
+        entries.erase(it);
+    }
+
+public:
+    static inline size_t budget = (size_t)64 << 20; // bytes of cached lines; 0 = no caching
+    struct Stats {
+        size_t hits = 0, misses = 0, evictions = 0;
+    } stats;
+
+    static FileCache& shared() {
+        static FileCache cache;
+        return cache;
+    }
+
+    // Lines of fileName read through load, or shared from an earlier read of the same file
+    template <typename F>
+    Value lines(const string& fileName, F load) {
+        Stamp stamp;
+        if (budget == 0 || !stampOf(fileName, stamp)) return load();
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = entries.find(fileName);
+            if (it != entries.end() && it->second.stamp == stamp) {
+                stats.hits++;
+                order.splice(order.begin(), order, it->second.recent);
+                auto& lines = it->second.lines;
+                return ArraySlice{lines, 0, lines->size()};
+            }
+            stats.misses++;
+        }
+
+        // Loaded without the lock, so one slow file does not hold up other reads
+        Value val = load();
+        auto arr = get_if<vector<Scalar>>(&val);
+        if (!arr) return val; // spilled or numeric: not kept
+        size_t size = arr->size() * sizeof(Scalar);
+        for (auto& s : *arr) {
+            if (auto str = get_if<string>(&s)) size += str->size();
+        }
+        if (size > budget) return val;
+
+        auto lines = make_shared<vector<Scalar>>(move(*arr));
+        lock_guard<mutex> lock(mtx);
+        auto it = entries.find(fileName);
+        if (it != entries.end()) drop(it);
+        order.push_front(fileName);
+        entries[fileName] = Entry{stamp, lines, size, order.begin()};
+        bytes += size;
+        while (bytes > budget) {
+            drop(entries.find(order.back()));
+            stats.evictions++;
+        }
+        return ArraySlice{lines, 0, lines->size()};
+    }
+
+    // Called when the script writes fileName, in case the write keeps its mtime
+    void forget(const string& fileName) {
+        lock_guard<mutex> lock(mtx);
+        auto it = entries.find(fileName);
+        if (it != entries.end()) drop(it);
+    }
+
+    void printStats(ostream& out) {
+        lock_guard<mutex> lock(mtx);
+        out << "File cache: " << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions
+            << " evictions\n  " << entries.size() << " files, " << bytes << " of " << budget << " bytes\n";
+    }
+};
+
+// Background file I/O for --async-io. A small thread pool runs the jobs;
+// every operation on a file waits for the previous one on the same file,
+// so reads and writes to one file complete in the order they were issued
+// while different files proceed in parallel with each other and the script.
+class IoEngine {
+    vector<thread> workers;
+    deque<function<void()>> queue;
+    mutex mtx;
+    condition_variable cv;
+    bool stopping = false;
+
+    struct LastOp {
+        shared_future<void> done;
+        const void* owner = nullptr;                               // promise behind done, to recognise the job
+    };
+    unordered_map<string, LastOp> lastOp;                          // per file: completion of the latest job
+    vector<pair<string, future<void>>> background;                 // fire-and-forget jobs, checked at drain
+
+public:
+    explicit IoEngine(unsigned threads) {
+        if (threads == 0) threads = 1;
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    ~IoEngine() {
+        drain();
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    // Queue job behind earlier operations on fileName; the future carries its result or exception
+    template <typename F>
+    auto submit(const string& fileName, F job) -> future<decltype(job())> {
+        using R = decltype(job());
+        string key = fileKey(fileName);
+        auto done = make_shared<promise<void>>();
+        shared_future<void> prev;
+        {
+            lock_guard<mutex> lock(mtx);
+            LastOp& last = lastOp[key];
+            prev = last.done;
+            last = {done->get_future().share(), done.get()};
+        }
+
+        auto task = make_shared<packaged_task<R()>>([this, key, prev, done, job = move(job)]() mutable -> R {
+            if (prev.valid()) prev.wait();
+            // Release the next job on this file however this one ends, and
+            // forget the file once nothing newer is queued on it
+            struct Signal {
+                IoEngine* io;
+                const string& key;
+                shared_ptr<promise<void>> p;
+                ~Signal() {
+                    p->set_value();
+                    lock_guard<mutex> lock(io->mtx);
+                    auto it = io->lastOp.find(key);
+                    if (it != io->lastOp.end() && it->second.owner == p.get()) io->lastOp.erase(it);
+                }
+            } signal{this, key, done};
+            return job();
+        });
+        future<R> result = task->get_future();
+        {
+            lock_guard<mutex> lock(mtx);
+            queue.emplace_back([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+    // Completion of the latest queued operation on fileName; invalid if there is none.
+    // Readers that open the file themselves wait on it to keep the per-file order
+    shared_future<void> pending(const string& fileName) {
+        string key = fileKey(fileName);
+        lock_guard<mutex> lock(mtx);
+        auto it = lastOp.find(key);
+        return it == lastOp.end() ? shared_future<void>() : it->second.done;
+    }
+
+    void await(const string& fileName) {
+        shared_future<void> done = pending(fileName);
+        if (done.valid()) done.wait();
+    }
+
+    // Queue a job nobody awaits; failures are reported by drain()
+    template <typename F>
+    void submitBackground(const string& fileName, F job) {
+        background.emplace_back(fileName, submit(fileName, move(job)));
+    }
+
+    // Wait for all background jobs and report the ones that failed
+    void drain(ostream& err = cerr) {
+        for (auto& [fileName, f] : background) {
+            try {
+                f.get();
+            } catch (const exception& e) {
+                err << "Error: background I/O on " << fileName << " failed: " << e.what() << "\n";
+            }
+        }
+        background.clear();
+    }
+
+private:
+    static string fileKey(const string& fileName) {
+        namespace fs = std::filesystem;
+        error_code ec;
+        fs::path p = fs::absolute(fs::path(fileName), ec);
+        return ec ? fileName : p.lexically_normal().string();
+    }
+
+    void workerLoop() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                job = move(queue.front());
+                queue.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// Update the variable storage to support arrays
+/* =====================
+   COROUTINE SCHEDULER
+   Runs many scripts on one thread. Each task gets its own small stack;
+   statements that would block (input, read, write, sleep, yield) switch back
+   to the event loop instead, which resumes tasks as their input arrives,
+   their file I/O completes on a helper thread or their timers expire.
+   ===================== */
+#ifndef _WIN32
+class Scheduler {
+    enum class State { READY, WAIT_FD, SLEEPING, WAIT_JOB, DONE };
+
+    struct Task {
+        ucontext_t context;
+        char* stack = nullptr; // mapping, guard page first
+        function<void()> body;
+        State state = State::READY;
+        int fd = -1;                              // WAIT_FD
+        chrono::steady_clock::time_point wakeAt;  // SLEEPING
+        future<Value> job;                        // WAIT_JOB
+    };
+
+    static thread_local Scheduler* active;
+
+    vector<unique_ptr<Task>> tasks;
+    Task* running = nullptr;
+    ucontext_t loopContext;
+    int wakePipe[2];
+    IoEngine jobs{2}; // file I/O runs here while the task waits
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+public:
+    static constexpr size_t STACK_SIZE = 8 << 20; // reserved; pages are committed as touched
+
+    Scheduler() {
+        if (pipe(wakePipe) != 0) throw runtime_error("Cannot create scheduler wake pipe");
+        fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+    }
+
+    ~Scheduler() {
+        for (auto& t : tasks) freeStack(*t);
+        close(wakePipe[0]);
+        close(wakePipe[1]);
+    }
+
+    // The scheduler of the calling task, or nullptr outside a task
+    static Scheduler* current() { return active && active->running ? active : nullptr; }
+
+    void spawn(function<void()> body) {
+        auto task = make_unique<Task>();
+        task->body = move(body);
+        size_t mapped = STACK_SIZE + pageSize;
+        void* mem = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) throw runtime_error("Cannot allocate task stack");
+        task->stack = (char*)mem;
+        mprotect(task->stack, pageSize, PROT_NONE); // overflow faults instead of corrupting memory
+        getcontext(&task->context);
+        task->context.uc_stack.ss_sp = task->stack + pageSize;
+        task->context.uc_stack.ss_size = STACK_SIZE;
+        task->context.uc_link = &loopContext;
+        makecontext(&task->context, &Scheduler::entry, 0);
+        tasks.push_back(move(task));
+    }
+
+    // Run until every task has finished
+    void run() {
+        active = this;
+        while (!tasks.empty()) {
+            auto now = chrono::steady_clock::now();
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                Task* t = tasks[i].get();
+                if (canRun(*t, now)) resume(t);
+            }
+            for (size_t i = 0; i < tasks.size();) {
+                if (tasks[i]->state == State::DONE) {
+                    freeStack(*tasks[i]);
+                    tasks[i] = move(tasks.back());
+                    tasks.pop_back();
+                } else {
+                    ++i;
+                }
+            }
+            if (!tasks.empty()) waitForEvents();
+        }
+        active = nullptr;
+    }
+
+    // === Called from inside a task ===
+    void yield() {
+        running->state = State::READY;
+        suspend();
+    }
+
+    void sleepFor(double millis) {
+        running->state = State::SLEEPING;
+        running->wakeAt = chrono::steady_clock::now() +
+                          chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(max(0.0, millis)));
+        suspend();
+    }
+
+    void waitReadable(int fd) {
+        running->state = State::WAIT_FD;
+        running->fd = fd;
+        suspend();
+    }
+
+    // Run job on a helper thread (after earlier jobs on the same file) and
+    // suspend the task until it is done; its exception, if any, is rethrown here
+    Value offload(const string& fileName, function<Value()> job) {
+        auto result = make_shared<promise<Value>>();
+        running->job = result->get_future();
+        jobs.submit(fileName, [this, result, job = move(job)]() {
+            try {
+                result->set_value(job());
+            } catch (...) {
+                result->set_exception(current_exception());
+            }
+            char byte = 0;
+            ssize_t ignore = write(wakePipe[1], &byte, 1);
+            (void)ignore;
+        });
+        running->state = State::WAIT_JOB;
+        suspend();
+        return running->job.get();
+    }
+
+    // Memory of the calling task's stack that is actually resident
+    size_t stackResident() const { return running ? resident(*running) : 0; }
+
+    // Number of tasks waiting on input, I/O or a timer, and the stack memory they hold
+    pair<size_t, size_t> suspendedMemory() const {
+        size_t count = 0, bytes = 0;
+        for (auto& t : tasks) {
+            if (t.get() == running || t->state == State::DONE) continue;
+            count++;
+            bytes += resident(*t) + sizeof(Task);
+        }
+        return {count, bytes};
+    }
+
+private:
+    static void entry() {
+        Task* task = active->running;
+        try {
+            task->body();
+        } catch (...) {
+            // the body reports its own errors; never unwind past the task's stack
+        }
+        task->state = State::DONE;
+    } // returns to loopContext through uc_link
+
+    void resume(Task* t) {
+        running = t;
+        t->state = State::READY;
+        swapcontext(&loopContext, &t->context);
+        running = nullptr;
+    }
+
+    void suspend() {
+        Task* t = running;
+        swapcontext(&t->context, &loopContext);
+    }
+
+    bool canRun(Task& t, chrono::steady_clock::time_point now) {
+        switch (t.state) {
+            case State::READY: return true;
+            case State::SLEEPING: return now >= t.wakeAt;
+            case State::WAIT_JOB: return t.job.wait_for(chrono::seconds(0)) == future_status::ready;
+            default: return false;
+        }
+    }
+
+    // Block until a task can make progress: ready input, finished I/O or an expired timer
+    void waitForEvents() {
+        int timeout = -1;
+        auto now = chrono::steady_clock::now();
+        vector<pollfd> fds{{wakePipe[0], POLLIN, 0}};
+        for (auto& t : tasks) {
+            if (canRun(*t, now)) return;
+            if (t->state == State::WAIT_FD) fds.push_back({t->fd, POLLIN, 0});
+            if (t->state == State::SLEEPING) {
+                auto ms = chrono::duration_cast<chrono::milliseconds>(t->wakeAt - now).count() + 1;
+                timeout = timeout < 0 ? (int)ms : min(timeout, (int)ms);
+            }
+        }
+        if (poll(fds.data(), fds.size(), timeout) <= 0) return;
+
+        char drain[64];
+        while (read(wakePipe[0], drain, sizeof drain) > 0) {}
+        for (auto& t : tasks) {
+            if (t->state != State::WAIT_FD) continue;
+            for (size_t i = 1; i < fds.size(); ++i) {
+                if (fds[i].fd == t->fd && fds[i].revents) t->state = State::READY;
+            }
+        }
+    }
+
+    size_t resident(const Task& t) const {
+        size_t pages = STACK_SIZE / pageSize;
+        vector<unsigned char> map(pages);
+        if (mincore(t.stack + pageSize, STACK_SIZE, map.data()) != 0) return 0;
+        size_t count = 0;
+        for (unsigned char m : map) count += m & 1;
+        return count * pageSize;
+    }
+
+    void freeStack(Task& t) {
+        if (t.stack) munmap(t.stack, STACK_SIZE + pageSize);
+        t.stack = nullptr;
+    }
+};
+
+thread_local Scheduler* Scheduler::active = nullptr;
+#else
+// Coroutine mode needs ucontext; on Windows scripts always run on their own thread
+class Scheduler {
+public:
+    static Scheduler* current() { return nullptr; }
+    void yield() {}
+    void sleepFor(double) {}
+    Value offload(const string&, function<Value()> job) { return job(); }
+};
+#endif
+
+class Interpreter {
+    unordered_map<string, Value> variables;
+
+    // Script I/O; the defaults are the process streams, server mode passes per-request ones
+    ostream& out;
+    ostream& err;
+    istream& in;
+    string baseDir; // relative file names in the script resolve against this, if set
+
+    // --async-io: background I/O engine and reads not yet awaited, by target variable
+    unique_ptr<IoEngine> io;
+    unordered_map<string, future<Value>> pendingReads;
+
+    Arena arena; // scratch memory for temporaries, rewound after every statement
+
+    // User function calls. Arguments and locals of all active calls live in one
+    // stack of value slots, reserved on first use so slot pointers stay valid
+    struct Frame {
+        const FuncStmt* fn;
+        size_t base; // index of the frame's first slot
+    };
+    static constexpr size_t STACK_SLOTS = 1 << 16;
+    vector<Value> stack;
+    vector<Frame> frames;
+    size_t frameBase = 0;        // base of the running function's frame
+    uintptr_t stackStart = 0;    // native stack address at the outermost call
+#ifdef _WIN32
+    size_t stackBudget = 512 << 10; // native stack nested calls may use (1 MiB main stack)
+#else
+    size_t stackBudget = 4 << 20;   // native stack nested calls may use (8 MiB default stack)
+#endif
+    bool returning = false;      // a return is leaving the running function body
+    Value returnValue;
+    const FuncStmt* tailCallee = nullptr; // set by a tail call: run this next in the same frame
+
+public:
+    Interpreter(ostream& o = cout, ostream& e = cerr, istream& i = cin) : out(o), err(e), in(i) {}
+
+    void setBaseDir(const string& dir) {
+        baseDir = dir;
+    }
+
+    // Coroutines run on small native stacks and need a lower limit
+    void setStackBudget(size_t bytes) {
+        stackBudget = bytes;
+    }
+
+    void enableAsyncIo(unsigned threads) {
+        io = make_unique<IoEngine>(threads);
+    }
+
+    void run(const vector<StmtPtr>& program) {
+        // Build line number to statement index mapping
+        unordered_map<int, size_t> lineToIndex;
+        for (size_t i = 0; i < program.size(); i++) {
+            lineToIndex[program[i]->line] = i;
+        }
+
+        size_t currentStmt = 0;
+        while (currentStmt < program.size()) {
+            try {
+                currentStmt = exec(program[currentStmt], program, lineToIndex, currentStmt);
+            } catch (const JumpException& e) {
+                // Handle jump by finding the target line
+                auto it = lineToIndex.find(e.targetLine);
+                if (it != lineToIndex.end()) {
+                    currentStmt = it->second;
+                } else {
+                    err << "Error: Cannot jump to line " << e.targetLine << " - line not found\n";
+                    break;
+                }
+            } catch (const BreakException&) {
+                break; // Exit the program
+            }
+        }
+        if (io) io->drain(err);
+    }
+
+    // Report per-node quickening results, one line per binary expression
+    void printQuickenStats(const vector<StmtPtr>& program, ostream& out) {
+        vector<BinaryExpr*> nodes;
+        for (auto& s : program) collectBinary(s, nodes);
+
+        size_t totalHits = 0, totalMisses = 0;
+        out << "Quickening stats (" << nodes.size() << " binary expressions):\n";
+        for (auto* b : nodes) {
+            out << "  line " << b->line << "  '" << b->op << "'  " << quickKindName(b->quick)
+                << (b->proven ? " (proven)" : "") << "  hits=" << b->hits << "  misses=" << b->misses << "\n";
+            totalHits += b->hits;
+            totalMisses += b->misses;
+        }
+        out << "  total hits=" << totalHits << "  misses=" << totalMisses << "\n";
+    }
+
+    void printArenaStats(ostream& out) const {
+        out << "Arena stats: " << arena.stats.allocations << " allocations, " << arena.stats.bytes
+            << " bytes over " << arena.stats.statements << " statements\n"
+            << "  peak in use=" << arena.stats.peak << " bytes  reserved=" << arena.reserved() << " bytes in "
+            << arena.blockCount() << " blocks\n";
+    }
+
+    // Peak heap use, what compiling took, and the variables holding the most memory
+    void printMemoryReport(ostream& out) const {
+#ifdef SPROUT_HAVE_MEMORY_METER
+        out << "Memory report: peak " << MemoryMeter::peak << " bytes, " << MemoryMeter::live << " bytes in use at exit\n"
+            << "  tokens " << MemoryMeter::tokens << " bytes  syntax tree " << MemoryMeter::syntaxTree
+            << " bytes  temporaries " << arena.reserved() << " bytes reserved\n";
+        vector<pair<size_t, const string*>> sizes;
+        size_t total = 0;
+        for (auto& [name, val] : variables) {
+            sizes.push_back({heapBytes(val), &name});
+            total += sizes.back().first;
+        }
+        size_t shown = min(sizes.size(), MEMORY_REPORT_VARIABLES);
+        partial_sort(sizes.begin(), sizes.begin() + shown, sizes.end(), greater<>());
+        out << "  variables " << total << " bytes in " << sizes.size() << " variables; largest:\n";
+        for (size_t i = 0; i < shown; ++i) {
+            out << "    " << *sizes[i].second << "  " << sizes[i].first << " bytes\n";
+        }
+#else
+        out << "Memory report: not available on this platform\n";
+#endif
+    }
+
+private:
+    static constexpr size_t MEMORY_REPORT_VARIABLES = 10;
+
+    static size_t heapBytes(const string& s) {
+        return s.capacity() > string().capacity() ? s.capacity() + 1 : 0; // short strings live inline
+    }
+
+    static size_t heapBytes(const Scalar& s) {
+        auto str = get_if<string>(&s);
+        return str ? heapBytes(*str) : 0;
+    }
+
+    // Estimated heap bytes behind a variable. A slice counts its whole shared array;
+    // a spilled array lives in files and counts nothing
+    static size_t heapBytes(const Value& val) {
+        size_t bytes = sizeof(Value);
+        if (auto s = get_if<string>(&val)) bytes += heapBytes(*s);
+        else if (auto arr = get_if<vector<Scalar>>(&val)) {
+            bytes += arr->capacity() * sizeof(Scalar);
+            for (auto& s : *arr) bytes += heapBytes(s);
+        } else if (auto sl = get_if<ArraySlice>(&val)) {
+            bytes += sl->base->capacity() * sizeof(Scalar);
+            for (auto& s : *sl->base) bytes += heapBytes(s);
+        } else if (auto nums = get_if<NumArray>(&val)) {
+            bytes += nums->capacity() * sizeof(double);
+        } else if (auto map = get_if<HashMap>(&val)) {
+            bytes += map->tableBytes();
+            map->forEach([&bytes](const Scalar& k, const Scalar& v) { bytes += heapBytes(k) + heapBytes(v); });
+        }
+        return bytes;
+    }
+
+    static const char* quickKindName(QuickKind k) {
+        switch (k) {
+            case QuickKind::UNQUICKENED: return "unquickened";
+            case QuickKind::GENERIC: return "generic";
+            case QuickKind::NUM_ADD: return "num+num";
+            case QuickKind::NUM_SUB: return "num-num";
+            case QuickKind::NUM_MUL: return "num*num";
+            case QuickKind::NUM_DIV: return "num/num";
+            case QuickKind::NUM_LT: return "num<num";
+            case QuickKind::NUM_GT: return "num>num";
+            case QuickKind::NUM_LE: return "num<=num";
+            case QuickKind::NUM_GE: return "num>=num";
+            case QuickKind::NUM_EQ: return "num==num";
+            case QuickKind::NUM_NE: return "num!=num";
+            case QuickKind::STR_EQ: return "str==str";
+            case QuickKind::STR_NE: return "str!=str";
+            case QuickKind::STR_LT: return "str<str";
+            case QuickKind::STR_GT: return "str>str";
+            case QuickKind::STR_LE: return "str<=str";
+            case QuickKind::STR_GE: return "str>=str";
+            case QuickKind::INT_ADD: return "int+int";
+            case QuickKind::INT_SUB: return "int-int";
+            case QuickKind::INT_MUL: return "int*int";
+            case QuickKind::INT_DIV: return "int/int";
+            case QuickKind::INT_LT: return "int<int";
+            case QuickKind::INT_GT: return "int>int";
+            case QuickKind::INT_LE: return "int<=int";
+            case QuickKind::INT_GE: return "int>=int";
+            case QuickKind::INT_EQ: return "int==int";
+            case QuickKind::INT_NE: return "int!=int";
+            case QuickKind::CONCAT: return "concat";
+        }
+        return "?";
+    }
+
+    static void collectBinary(const ExprPtr& expr, vector<BinaryExpr*>& out) {
+        if (!expr) return;
+        forEachOperand(expr, [&out](ExprPtr& e) { collectBinary(e, out); });
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) out.push_back(b);
+    }
+
+    static void collectBinary(const StmtPtr& stmt, vector<BinaryExpr*>& out) {
+        forEachStmt(stmt, [&out](const StmtPtr& s) {
+            forEachExpr(s, [&out](ExprPtr& e) { collectBinary(e, out); });
+        });
+    }
+
+    // Exception classes for control flow
+    class JumpException : public exception {
+    public:
+        int targetLine;
         JumpException(int line) : targetLine(line) {}
     };
 
-    class BreakException : public exception {};
+    class BreakException : public exception {};
+
+    // Runs one statement and returns the next statement index. Running out of
+    // memory, or past --max-memory, is reported against the innermost statement
+    size_t exec(const StmtPtr& stmt, const vector<StmtPtr>& program,
+                const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
+        try {
+            return dispatch(stmt, program, lineToIndex, currentIndex);
+        } catch (const bad_alloc&) {
+            throw runtime_error(MemoryMeter::outOfMemory(stmt->line));
+        }
+    }
+
+    size_t dispatch(const StmtPtr& stmt, const vector<StmtPtr>& program,
+                    const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
+        Arena::Scope scratch(arena);
+        if (auto d = dynamic_pointer_cast<DeclStmt>(stmt)) {
+            execDecl(d);
+            return currentIndex + 1;
+        }
+        else if (auto a = dynamic_pointer_cast<AssignStmt>(stmt)) {
+            execAssign(a);
+            return currentIndex + 1;
+        }
+        else if (auto aa = dynamic_pointer_cast<ArrayAssignStmt>(stmt)) {
+            execArrayAssign(aa);
+            return currentIndex + 1;
+        }
+        else if (auto r = dynamic_pointer_cast<ReturnStmt>(stmt)) {
+            execReturn(*r);
+            return currentIndex + 1;
+        }
+        else if (auto c = dynamic_pointer_cast<CallStmt>(stmt)) {
+            call(static_cast<const CallExpr&>(*c->call));
+            return currentIndex + 1;
+        }
+        else if (dynamic_pointer_cast<FuncStmt>(stmt) || dynamic_pointer_cast<ImportStmt>(stmt)) {
+            return currentIndex + 1; // linked before the program starts
+        }
+        else if (auto p = dynamic_pointer_cast<PrintStmt>(stmt)) {
+            execPrint(p);
+            return currentIndex + 1;
+        }
+        else if (auto i = dynamic_pointer_cast<InputStmt>(stmt)) {
+            execInput(i);
+            return currentIndex + 1;
+        }
+        else if (auto ifs = dynamic_pointer_cast<IfStmt>(stmt)) {
+            return execIf(ifs, program, lineToIndex, currentIndex);
+        }
+        else if (auto e = dynamic_pointer_cast<EachStmt>(stmt)) {
+            return execEach(e, program, lineToIndex, currentIndex);
+        }
+        else if (auto j = dynamic_pointer_cast<JumpStmt>(stmt)) {
+            throw JumpException(j->jumpTo);
+        }
+        else if (auto b = dynamic_pointer_cast<BreakStmt>(stmt)) {
+            throw BreakException();
+        }
+        else if (auto sl = dynamic_pointer_cast<SleepStmt>(stmt)) {
+            execSleep(sl);
+            return currentIndex + 1;
+        }
+        else if (dynamic_pointer_cast<YieldStmt>(stmt)) {
+            if (auto sched = Scheduler::current()) sched->yield();
+            return currentIndex + 1;
+        }
+        else if (auto r = dynamic_pointer_cast<RandomStmt>(stmt)) {
+            execRandom(r);
+            return currentIndex + 1;
+        }
+        else if (auto rd = dynamic_pointer_cast<ReadStmt>(stmt)) {
+            execRead(rd);
+            return currentIndex + 1;
+        }
+        else if (auto l = dynamic_pointer_cast<LengthStmt>(stmt)) {
+            execLength(l);
+            return currentIndex + 1;
+        }
+        else if (auto w = dynamic_pointer_cast<WriteStmt>(stmt)) {
+            execWrite(w);
+            return currentIndex + 1;
+        }
+        else if (auto m = dynamic_pointer_cast<MakefileStmt>(stmt)) {
+            execMakefile(m);
+            return currentIndex + 1;
+        }
+        else if (auto d = dynamic_pointer_cast<DelfileStmt>(stmt)) {
+            execDelfile(d);
+            return currentIndex + 1;
+        }
+        else if (auto mp = dynamic_pointer_cast<MapPutStmt>(stmt)) {
+            execMapPut(mp);
+            return currentIndex + 1;
+        }
+        else if (auto mg = dynamic_pointer_cast<MapGetStmt>(stmt)) {
+            execMapGet(mg);
+            return currentIndex + 1;
+        }
+        else if (auto md = dynamic_pointer_cast<MapDelStmt>(stmt)) {
+            execMapDel(md);
+            return currentIndex + 1;
+        }
+        else if (auto mh = dynamic_pointer_cast<MapHasStmt>(stmt)) {
+            execMapHas(mh);
+            return currentIndex + 1;
+        }
+        else if (auto so = dynamic_pointer_cast<SortStmt>(stmt)) {
+            execSort(so);
+            return currentIndex + 1;
+        }
+        else if (auto se = dynamic_pointer_cast<SearchStmt>(stmt)) {
+            execSearch(se);
+            return currentIndex + 1;
+        }
+        else if (auto so = dynamic_pointer_cast<StringOpStmt>(stmt)) {
+            execStringOp(so);
+            return currentIndex + 1;
+        }
+        else {
+            throw runtime_error("Unknown statement type");
+        }
+    }
+
+    size_t execIf(const shared_ptr<IfStmt>& stmt, const vector<StmtPtr>& program,
+                  const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
+        for (auto& branch : stmt->branches) {
+            ExprPtr cond = branch.first;
+            auto& body = branch.second;
+
+            if (!cond) {
+                // Else branch - execute all statements in else body WITHOUT advancing the global index
+                for (auto& s : body) {
+                    size_t ignore = exec(s, program, lineToIndex, currentIndex);
+                    (void)ignore;
+                    if (returning) break;
+                }
+                return currentIndex + 1;
+            }
+
+            bool truthy = false;
+            auto b = dynamic_cast<BinaryExpr*>(cond.get());
+            if (b && b->proven && b->quick != QuickKind::CONCAT) {
+                // Proven conditions are tested without building a Value
+                b->hit();
+                truthy = isFloatArith(b->quick) ? evalProvenDouble(*b) != 0 : evalProvenInt(*b) != 0;
+            } else {
+                auto condVal = eval(cond);
+                if (holds_alternative<int64_t>(condVal)) {
+                    truthy = (get<int64_t>(condVal) != 0);
+                } else if (holds_alternative<double>(condVal)) {
+                    truthy = (get<double>(condVal) != 0);
+                } else if (holds_alternative<string>(condVal)) {
+                    truthy = !get<string>(condVal).empty();
+                }
+            }
+
+            if (truthy) {
+                // Execute all statements in if body WITHOUT advancing the global index
+                for (auto& s : body) {
+                    size_t ignore = exec(s, program, lineToIndex, currentIndex);
+                    (void)ignore;
+                    if (returning) break;
+                }
+                return currentIndex + 1;
+            }
+        }
+        return currentIndex + 1;
+    }
+
+    size_t execEach(const shared_ptr<EachStmt>& stmt, const vector<StmtPtr>& program,
+                    const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
+        string fileName = resolvePath(stmt->fileName);
+        if (io) io->await(fileName);
+        LineReader reader(fileName, in);
+        string line;
+        if (stmt->blockSize <= 0) {
+            while (!returning && reader.next(line)) {
+                setVar(stmt->varName, line);
+                for (auto& s : stmt->body) {
+                    size_t ignore = exec(s, program, lineToIndex, currentIndex);
+                    (void)ignore;
+                    if (returning) break;
+                }
+            }
+            return currentIndex + 1;
+        }
+
+        vector<Scalar> block;
+        while (true) {
+            block.clear();
+            while ((int)block.size() < stmt->blockSize && reader.next(line)) {
+                block.push_back(line);
+            }
+            if (block.empty()) break;
+            setVar(stmt->varName, block);
+            for (auto& s : stmt->body) {
+                size_t ignore = exec(s, program, lineToIndex, currentIndex);
+                (void)ignore;
+                if (returning) break;
+            }
+            if (returning) break;
+        }
+        return currentIndex + 1;
+    }
+
+    void execDecl(const shared_ptr<DeclStmt>& stmt) {
+        auto val = eval(stmt->init);
+        StaticType target = stmt->type == "int" ? StaticType::INT
+                          : stmt->type == "float" ? StaticType::FLOAT : StaticType::DYNAMIC;
+        // A dynamic initializer is only known to be a number once it has been evaluated
+        if (!coerce(val, target)) {
+            throw runtime_error("cannot initialize " + stmt->type + " '" + stmt->name + "' with " +
+                                kindName(val) + " on line " + to_string(stmt->line));
+        }
+        if (stmt->slot >= 0) stack[frameBase + stmt->slot] = move(val);
+        else setVar(stmt->name, move(val));
+    }
+
+    void execAssign(const shared_ptr<AssignStmt>& stmt) {
+        auto val = eval(stmt->expr);
+        if (!coerce(val, stmt->target)) {
+            throw runtime_error(string("cannot assign ") + kindName(val) + " to " +
+                                TypeChecker::typeName(stmt->target) + " variable '" + stmt->name +
+                                "' on line " + to_string(stmt->line));
+        }
+        if (stmt->slot >= 0) stack[frameBase + stmt->slot] = move(val);
+        else setVar(stmt->name, move(val));
+    }
+
+    void execArrayAssign(const shared_ptr<ArrayAssignStmt>& stmt) {
+        // Find the array variable
+        Value* it = findVar(stmt->arrayName);
+        if (!it) {
+            throw runtime_error("Undefined array: " + stmt->arrayName);
+        }
+
+        if (auto nums = get_if<NumArray>(it)) {
+            size_t index = toIndex(eval(stmt->index), nums->size());
+            auto val = eval(stmt->expr);
+            if (isNumber(val)) {
+                (*nums)[index] = asDouble(val);
+                return;
+            }
+            if (!isScalar(val)) {
+                throw runtime_error("Cannot assign array to array element");
+            }
+            // A non-number turns the dense array back into a general one
+            *it = toGeneralArray(*nums);
+            get<vector<Scalar>>(*it)[index] = toScalar(move(val));
+            return;
+        }
+
+        if (auto spilled = get_if<SpillArray>(it)) {
+            auto val = eval(stmt->expr);
+            if (!isScalar(val)) {
+                throw runtime_error("Cannot assign array to array element");
+            }
+            spilled->set(toIndex(eval(stmt->index), spilled->size()), toScalar(move(val)));
+            return;
+        }
+        
+        // Make sure it's actually an array
+        if (!isScalarArray(*it)) {
+            throw runtime_error("Variable " + stmt->arrayName + " is not an array");
+        }
+        
+        // Evaluate the expression first: a slice of this array would re-home its storage
+        auto val = eval(stmt->expr);
+        if (!isScalar(val)) {
+            throw runtime_error("Cannot assign array to array element");
+        }
+        size_t index = toIndex(eval(stmt->index), scalarsOf(*it).size());
+        ownArray(*it)[index] = toScalar(move(val));
+    }
+
+    void execPrint(const shared_ptr<PrintStmt>& stmt) {
+        // Printed concatenations never leave scratch memory
+        if (auto b = dynamic_cast<BinaryExpr*>(stmt->expr.get())) {
+            if (b->proven && b->quick == QuickKind::CONCAT) {
+                b->hit();
+                pmr::string text(&arena);
+                appendText(b->left, text);
+                appendText(b->right, text);
+                text += '\n';
+                out.write(text.data(), text.size());
+                return;
+            }
+        }
+        if (auto s = dynamic_cast<const StringExpr*>(stmt->expr.get())) {
+            out << s->value << "\n";
+            return;
+        }
+        if (auto v = dynamic_cast<const VarExpr*>(stmt->expr.get())) {
+            Value* it = findVar(*v);
+            if (it) return printValue(*it);
+        }
+        printValue(eval(stmt->expr));
+    }
+
+    void printValue(const Value& val) {
+        if (holds_alternative<int64_t>(val)) {
+            out << get<int64_t>(val) << "\n";
+        } else if (holds_alternative<double>(val)) {
+            out << get<double>(val) << "\n";
+        } else if (holds_alternative<string>(val)) {
+            out << get<string>(val) << "\n";
+        } else if (isScalarArray(val)) {
+            out << "[";
+            ScalarSpan arr = scalarsOf(val);
+            for (size_t i = 0; i < arr.size(); ++i) {
+                if (i > 0) out << ", ";
+                if (holds_alternative<int64_t>(arr[i])) {
+                    out << get<int64_t>(arr[i]);
+                } else if (holds_alternative<double>(arr[i])) {
+                    out << get<double>(arr[i]);
+                } else {
+                    out << get<string>(arr[i]);
+                }
+            }
+            out << "]\n";
+        } else if (holds_alternative<NumArray>(val)) {
+            out << "[";
+            auto& arr = get<NumArray>(val);
+            for (size_t i = 0; i < arr.size(); ++i) {
+                if (i > 0) out << ", ";
+                out << arr[i];
+            }
+            out << "]\n";
+        } else if (auto spilled = get_if<SpillArray>(&val)) {
+            out << "[";
+            bool first = true;
+            spilled->forEach([&](const Scalar& s) {
+                if (!first) out << ", ";
+                first = false;
+                visit([this](auto& x) { out << x; }, s);
+            });
+            out << "]\n";
+        } else if (holds_alternative<HashMap>(val)) {
+            out << toString(val) << "\n";
+        }
+    }
+
+    void execInput(const shared_ptr<InputStmt>& stmt) {
+        out << stmt->question << " ";
+        string userInput;
+        getline(in, userInput);
+
+        // If var was declared as number → convert
+        Value* it = findVar(stmt->name);
+        if (it && holds_alternative<int64_t>(*it)) {
+            *it = (int64_t)stoll(userInput);
+        } else if (it && holds_alternative<double>(*it)) {
+            *it = stod(userInput);
+        } else {
+            setVar(stmt->name, userInput);
+        }
+    }
+
+    void execSleep(const shared_ptr<SleepStmt>& stmt) {
+        double millis = evalNumber(stmt->millis);
+        if (auto sched = Scheduler::current()) {
+            sched->sleepFor(millis);
+        } else if (millis > 0) {
+            this_thread::sleep_for(chrono::duration<double, milli>(millis));
+        }
+    }
+
+    void execRandom(const shared_ptr<RandomStmt>& stmt) {
+        std::random_device rd;
+        std::mt19937 gen(rd());
+        std::uniform_int_distribution<> dist(stmt->min, stmt->max);
+        int64_t val = dist(gen);
+        setVar(stmt->name, val);
+    }
+
+    void execRead(const shared_ptr<ReadStmt>& stmt) {
+        // Reading into a map loads key/value pairs instead of lines
+        bool numeric = stmt->numeric;
+        bool intoMap = false;
+        if (!numeric) {
+            Value* target = findVar(stmt->varName);
+            intoMap = target && holds_alternative<HashMap>(*target);
+        }
+        string fileName = resolvePath(stmt->fileName);
+
+        if (auto sched = Scheduler::current()) {
+            // Let other scripts run while a helper thread reads the file
+            shared_future<void> earlier = io ? io->pending(fileName) : shared_future<void>();
+            setVar(stmt->varName, sched->offload(fileName, [fileName, intoMap, numeric, earlier]() -> Value {
+                if (earlier.valid()) earlier.wait();
+                if (numeric) return readNumbers(fileName);
+                if (intoMap) return readKeyValues(fileName);
+                return cachedLines(fileName);
+            }));
+            return;
+        }
+        if (io && !findLocal(stmt->varName)) {
+            // Issue the read and return; the variable is awaited on first use
+            pendingReads[stmt->varName] = io->submit(fileName, [fileName, intoMap, numeric]() -> Value {
+                if (numeric) return readNumbers(fileName);
+                if (intoMap) return readKeyValues(fileName);
+                return cachedLines(fileName);
+            });
+            return;
+        }
+        if (io) io->await(fileName);
+        if (numeric) setVar(stmt->varName, readNumbers(fileName));
+        else if (intoMap) setVar(stmt->varName, readKeyValues(fileName));
+        else setVar(stmt->varName, cachedLines(fileName));
+    }
+
+    static Value cachedLines(const string& fileName) {
+        return FileCache::shared().lines(fileName, [&fileName] { return readLines(fileName); });
+    }
+
+    // Lines go to the heap until they pass SpillArray::limit bytes, then everything
+    // moves to spill files and the rest of the file is streamed straight there
+    static Value readLines(const string& fileName) {
+        if (isArrayFile(fileName)) return loadArrayFile(fileName, false);
+        LineReader file(fileName);
+        vector<Scalar> arr;
+        string line;
+        size_t bytes = 0;
+        while (file.next(line)) {
+            bytes += sizeof(Scalar) + line.size();
+            if (SpillArray::limit && bytes > SpillArray::limit) {
+                SpillArray spilled;
+                for (auto& s : arr) spilled.push_back(s);
+                vector<Scalar>().swap(arr);
+                do {
+                    spilled.push_back(line);
+                } while (file.next(line));
+                return spilled;
+            }
+            arr.push_back(move(line));
+        }
+        return arr;
+    }
+
+    // Contents of a file, decompressed if it is gzip or zstd
+    static string readWhole(const string& fileName) {
+        FILE* file = fopen(fileName.c_str(), "rb");
+        if (!file) {
+            throw runtime_error("Cannot open file " + fileName);
+        }
+        string data;
+        if (Codec codec = sniffCodec(file); codec != Codec::NONE) {
+            Decompressor inflater(file, codec, fileName);
+            size_t n;
+            do {
+                size_t at = data.size();
+                data.resize(at + LineReader::BUFFER_SIZE);
+                n = inflater.read(data.data() + at, LineReader::BUFFER_SIZE);
+                data.resize(at + n);
+            } while (n > 0);
+            return data;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        data.resize(size > 0 ? (size_t)size : 0);
+        data.resize(fread(data.data(), 1, data.size(), file));
+        fclose(file);
+        return data;
+    }
+
+    // Malformed entries found while parsing one chunk of a numeric file
+    struct NumberErrors {
+        size_t count = 0;
+        vector<pair<size_t, string>> samples; // (line within the chunk, text), first few only
+    };
+
+    // Parse numbers separated by whitespace, commas or newlines; returns the number of lines seen
+    static size_t parseNumberChunk(const char* p, const char* end, NumArray& out, NumberErrors& errors) {
+        size_t line = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '\n') { ++line; ++p; continue; }
+            if (c == ' ' || c == '\t' || c == '\r' || c == ',') { ++p; continue; }
+
+            const char* tokEnd = p;
+            while (tokEnd < end && *tokEnd != '\n' && *tokEnd != ' ' && *tokEnd != '\t' &&
+                   *tokEnd != '\r' && *tokEnd != ',') ++tokEnd;
+            const char* first = (*p == '+') ? p + 1 : p; // from_chars rejects a leading '+'
+            bool signedTwice = first != p && first < tokEnd && (*first == '-' || *first == '+');
+            double d;
+            auto res = from_chars(first, tokEnd, d);
+            if (!signedTwice && res.ec == errc() && res.ptr == tokEnd) {
+                out.push_back(d);
+            } else {
+                if (errors.samples.size() < 10) errors.samples.emplace_back(line, string(p, tokEnd));
+                errors.count++;
+            }
+            p = tokEnd;
+        }
+        return line;
+    }
+
+    // readnum : load a whole file of numbers into a dense array. Large files are
+    // split at newlines and the pieces parsed on several threads
+    static NumArray readNumbers(const string& fileName) {
+        if (isArrayFile(fileName)) return get<NumArray>(loadArrayFile(fileName, true));
+        string data = readWhole(fileName);
+
+        const size_t minChunk = 1 << 20;
+        size_t threads = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), data.size() / minChunk));
+
+        // Chunk boundaries just after a newline, so every number lies in one chunk
+        vector<size_t> bounds{0};
+        for (size_t i = 1; i < threads; ++i) {
+            size_t at = data.size() * i / threads;
+            const void* nl = memchr(data.data() + at, '\n', data.size() - at);
+            size_t cut = nl ? (const char*)nl - data.data() + 1 : data.size();
+            if (cut > bounds.back()) bounds.push_back(cut);
+        }
+        if (bounds.back() != data.size()) bounds.push_back(data.size());
+        size_t chunks = bounds.size() - 1;
+
+        vector<NumArray> parts(chunks);
+        vector<NumberErrors> errors(chunks);
+        vector<size_t> lines(chunks);
+        auto work = [&](size_t c) {
+            parts[c].reserve((bounds[c + 1] - bounds[c]) / 4);
+            lines[c] = parseNumberChunk(data.data() + bounds[c], data.data() + bounds[c + 1], parts[c], errors[c]);
+        };
+        vector<thread> pool;
+        for (size_t c = 1; c < chunks; ++c) pool.emplace_back(work, c);
+        if (chunks > 0) work(0);
+        for (auto& t : pool) t.join();
+
+        // Report malformed entries with file line numbers
+        size_t errorCount = 0, firstLine = 1;
+        string report;
+        for (size_t c = 0; c < chunks; ++c) {
+            for (auto& [line, text] : errors[c].samples) {
+                if (report.size() < 400) report += "\n  line " + to_string(firstLine + line) + ": '" + text + "'";
+            }
+            errorCount += errors[c].count;
+            firstLine += lines[c];
+        }
+        if (errorCount > 0) {
+            throw runtime_error("Malformed number" + string(errorCount > 1 ? "s" : "") + " in " + fileName +
+                                " (" + to_string(errorCount) + " total):" + report);
+        }
+
+        size_t total = 0;
+        for (auto& part : parts) total += part.size();
+        NumArray result;
+        result.reserve(total);
+        for (auto& part : parts) result.insert(result.end(), part.begin(), part.end());
+        return result;
+    }
+
+    // "key<TAB>value" lines, or "key=value" when there is no tab
+    static HashMap readKeyValues(const string& fileName) {
+        LineReader file(fileName);
+        HashMap map;
+        string line;
+        while (file.next(line)) {
+            size_t sep = line.find('\t');
+            if (sep == string::npos) sep = line.find('=');
+            if (sep == string::npos) {
+                map.insert(line, string());
+            } else {
+                map.insert(line.substr(0, sep), line.substr(sep + 1));
+            }
+        }
+        return map;
+    }
+
+    void execLength(const shared_ptr<LengthStmt>& stmt) {
+        // Look up the array variable
+        Value* it = findVar(stmt->ArrayName);
+        if (!it) {
+            throw runtime_error("Undefined variable: " + stmt->ArrayName);
+        }
+
+        if (auto map = get_if<HashMap>(it)) {
+            setVar(stmt->varName, (int64_t)map->size());
+            return;
+        }
+        if (auto nums = get_if<NumArray>(it)) {
+            setVar(stmt->varName, (int64_t)nums->size());
+            return;
+        }
+        if (auto spilled = get_if<SpillArray>(it)) {
+            setVar(stmt->varName, (int64_t)spilled->size());
+            return;
+        }
+
+        // Make sure it's actually an array
+        if (!isScalarArray(*it)) {
+            throw runtime_error("Variable " + stmt->ArrayName + " is not an array");
+        }
+
+        // Get the actual size of the array
+        int64_t len = scalarsOf(*it).size();
+        setVar(stmt->varName, len);
+    }
+
+    void execWrite(const shared_ptr<WriteStmt>& stmt) {
+        // Look up the array variable
+        Value* it = findVar(stmt->ArrayName);
+        if (!it) {
+            throw runtime_error("Undefined variable: " + stmt->ArrayName);
+        }
+        if (isScalar(*it)) {
+            throw runtime_error("Variable " + stmt->ArrayName + " is not an array or map");
+        }
+
+        if (auto sched = Scheduler::current()) {
+            // The script is suspended until the write is done, so no snapshot is needed
+            const Value& val = *it;
+            string fileName = resolvePath(stmt->fileName);
+            shared_future<void> earlier = io ? io->pending(fileName) : shared_future<void>();
+            sched->offload(fileName, [&val, fileName, earlier]() -> Value {
+                if (earlier.valid()) earlier.wait();
+                writeContainer(fileName, val);
+                return Value();
+            });
+            return;
+        }
+        if (io) {
+            // Write a snapshot in the background, after earlier operations on the same file
+            string fileName = resolvePath(stmt->fileName);
+            io->submitBackground(fileName, [fileName, snapshot = *it]() {
+                writeContainer(fileName, snapshot);
+            });
+            return;
+        }
+        writeContainer(resolvePath(stmt->fileName), *it);
+    }
+
+    static void writeContainer(const string& fileName, const Value& val) {
+        FileCache::shared().forget(fileName);
+        fstream file(fileName);
+        if (!file.is_open()) {
+            throw runtime_error("Cannot open file " + fileName);
+        }
+
+        if (isArrayFile(fileName)) {
+            file.close();
+            writeArrayFile(fileName, val);
+            return;
+        }
+
+        // name.gz and name.zst are replaced by a compressed stream
+        if (Codec codec = codecOfName(fileName); codec != Codec::NONE) {
+            file.close();
+            CompressOutBuf compressed(fileName, codec);
+            ostream out(&compressed);
+            writeItems(out, val);
+            compressed.finish();
+            return;
+        }
+        writeItems(file, val);
+        file.close();
+    }
+
+    static void writeItems(ostream& file, const Value& val) {
+        // Maps are written as "key<TAB>value" lines, the format execRead loads back
+        if (auto map = get_if<HashMap>(&val)) {
+            map->forEach([&](const Scalar& k, const Scalar& v) {
+                file << scalarToString(k) << "\t" << scalarToString(v) << "\n";
+            });
+            return;
+        }
+
+        if (auto nums = get_if<NumArray>(&val)) {
+            for (double d : *nums) file << std::to_string(d) << "\n";
+            return;
+        }
+
+        if (auto spilled = get_if<SpillArray>(&val)) {
+            spilled->forEach([&file](const Scalar& s) {
+                if (auto str = get_if<string>(&s)) file << *str << "\n";
+                else if (auto i = get_if<int64_t>(&s)) file << std::to_string(*i) << "\n";
+                else file << std::to_string(get<double>(s)) << "\n";
+            });
+            return;
+        }
+
+        for (auto& s : scalarsOf(val)) {
+            string temp;
+            if (holds_alternative<int64_t>(s)) {
+                temp = std::to_string(get<int64_t>(s));
+            }
+            else if (holds_alternative<double>(s)) {
+                temp = std::to_string(get<double>(s));
+            }
+            else if (holds_alternative<string>(s)) {
+                temp = get<string>(s);
+            }
+            file << temp << "\n";
+        }
+    }
+
+    void execMakefile(const shared_ptr<MakefileStmt>& stmt) {
+        string filename;
+        filename = resolvePath(stmt->filename);
+        if (io) {
+            io->submitBackground(filename, [filename]() {
+                ofstream file(filename);
+                if (!file.is_open()) throw runtime_error("Cannot create file " + filename);
+                file << std::endl;
+            });
+            return;
+        }
+        ofstream file(filename);
+        if (!file.is_open()) {
+            out << "Cannot create file" + filename + "\n";
+        }
+        file << std::endl;
+        file.close();
+    }
+
+    void execDelfile(const shared_ptr<DelfileStmt>& stmt) {
+        string filename;
+        filename = resolvePath(stmt->filename);
+        if (io) {
+            io->submitBackground(filename, [filename]() { remove(filename.c_str()); });
+            return;
+        }
+        remove(filename.c_str());
+    }
+
+    string resolvePath(const string& fileName) const {
+        namespace fs = std::filesystem;
+        if (baseDir.empty() || fileName == "-" || fs::path(fileName).is_absolute()) return fileName;
+        return (fs::path(baseDir) / fileName).string();
+    }
+
+    // Local of the running function, or nullptr
+    Value* findLocal(const string& name) {
+        if (frames.empty()) return nullptr;
+        auto& slots = frames.back().fn->slots;
+        auto s = slots.find(name);
+        return s == slots.end() ? nullptr : &stack[frameBase + s->second];
+    }
+
+    Value* findVar(const string& name) {
+        if (Value* local = findLocal(name)) return local;
+        return findGlobal(name);
+    }
+
+    // Names resolved by the FunctionResolver skip the local search
+    Value* findVar(const VarExpr& v) {
+        if (v.slot >= 0) return &stack[frameBase + v.slot];
+        return findGlobal(v.name);
+    }
+
+    // Global lookup that first waits for an outstanding async read into it
+    Value* findGlobal(const string& name) {
+        if (!pendingReads.empty()) {
+            auto p = pendingReads.find(name);
+            if (p != pendingReads.end()) {
+                future<Value> f = move(p->second);
+                pendingReads.erase(p);
+                variables[name] = f.get(); // rethrows a failed read here, at first use
+            }
+        }
+        auto it = variables.find(name);
+        return it == variables.end() ? nullptr : &it->second;
+    }
+
+    // Assigning a variable supersedes any async read still targeting it
+    void setVar(const string& name, Value val) {
+        if (Value* local = findLocal(name)) {
+            *local = move(val);
+            return;
+        }
+        if (!pendingReads.empty()) pendingReads.erase(name);
+        variables[name] = move(val);
+    }
+
+    HashMap& lookupMap(const string& name) {
+        Value* it = findVar(name);
+        if (!it) {
+            throw runtime_error("Undefined map: " + name);
+        }
+        if (!holds_alternative<HashMap>(*it)) {
+            throw runtime_error("Variable " + name + " is not a map");
+        }
+        return get<HashMap>(*it);
+    }
+
+    Scalar evalKey(const ExprPtr& expr) {
+        auto key = eval(expr);
+        if (!isScalar(key)) {
+            throw runtime_error("Map key must be a number or string");
+        }
+        return toScalar(move(key));
+    }
+
+    void execMapPut(const shared_ptr<MapPutStmt>& stmt) {
+        Scalar key = evalKey(stmt->key);
+        auto val = eval(stmt->value);
+        if (!isScalar(val)) {
+            throw runtime_error("Cannot store an array or map as a map value");
+        }
+        lookupMap(stmt->mapName).insert(move(key), toScalar(move(val)));
+    }
+
+    void execMapGet(const shared_ptr<MapGetStmt>& stmt) {
+        Scalar key = evalKey(stmt->key);
+        Scalar* found = lookupMap(stmt->mapName).find(key);
+        if (!found) {
+            throw runtime_error("Key not found in map " + stmt->mapName + ": " + scalarToString(key));
+        }
+        setVar(stmt->varName, fromScalar(*found));
+    }
+
+    void execMapDel(const shared_ptr<MapDelStmt>& stmt) {
+        Scalar key = evalKey(stmt->key);
+        lookupMap(stmt->mapName).erase(key);
+    }
+
+    void execMapHas(const shared_ptr<MapHasStmt>& stmt) {
+        Scalar key = evalKey(stmt->key);
+        setVar(stmt->varName, (int64_t)(lookupMap(stmt->mapName).contains(key) ? 1 : 0));
+    }
+
+    // === User functions ===
+    Value call(const CallExpr& c) {
+        const FuncStmt* fn = c.fn;
+        // Recursion depth is bounded by native stack use (stacks grow down)
+        char marker;
+        uintptr_t here = (uintptr_t)&marker;
+        if (frames.empty()) stackStart = here;
+        else if (stackStart - here > stackBudget) {
+            throw runtime_error("Call stack overflow calling " + fn->name + " on line " + to_string(c.line));
+        }
+        if (stack.capacity() == 0) stack.reserve(STACK_SLOTS);
+
+        // Arguments are evaluated in the caller's frame, straight into the new one
+        size_t base = stack.size();
+        pushArgs(c);
+        growFrame(*fn, base);
+        frames.push_back({fn, base});
+        frameBase = base;
+        struct FramePop {
+            Interpreter& self;
+            size_t base;
+            ~FramePop() {
+                self.stack.resize(base);
+                self.frames.pop_back();
+                self.frameBase = self.frames.empty() ? 0 : self.frames.back().base;
+            }
+        } pop{*this, base};
+
+        while (true) {
+            runBody(*fn);
+            if (!tailCallee) break;
+            fn = tailCallee;
+            tailCallee = nullptr;
+            returning = false;
+            frames.back().fn = fn;
+        }
+        Value result = returning ? move(returnValue) : Value();
+        returning = false;
+        return result;
+    }
+
+    void pushArgs(const CallExpr& c) {
+        for (auto& a : c.args) {
+            Value v = eval(a);
+            if (stack.size() == stack.capacity()) {
+                throw runtime_error("Call stack overflow calling " + c.name + " on line " + to_string(c.line));
+            }
+            stack.push_back(move(v));
+        }
+    }
+
+    // Locals after the arguments start out as 0
+    void growFrame(const FuncStmt& fn, size_t base) {
+        if (base + fn.slots.size() > stack.capacity()) {
+            throw runtime_error("Call stack overflow calling " + fn.name);
+        }
+        stack.resize(base + fn.slots.size());
+    }
+
+    void runBody(const FuncStmt& fn) {
+        size_t i = 0;
+        while (i < fn.body.size() && !returning) {
+            try {
+                i = exec(fn.body[i], fn.body, fn.lineToIndex, i);
+            } catch (const JumpException& e) {
+                auto it = fn.lineToIndex.find(e.targetLine);
+                if (it == fn.lineToIndex.end()) {
+                    err << "Error: Cannot jump to line " << e.targetLine << " - not in function " << fn.name << "\n";
+                    throw BreakException();
+                }
+                i = it->second;
+            }
+        }
+    }
+
+    void execReturn(const ReturnStmt& stmt) {
+        if (stmt.tail) {
+            // Evaluate the arguments above the frame, then slide them down over it
+            auto& c = static_cast<const CallExpr&>(*stmt.expr);
+            size_t top = stack.size();
+            pushArgs(c);
+            size_t base = frames.back().base;
+            move(stack.begin() + top, stack.end(), stack.begin() + base);
+            stack.resize(base + c.args.size());
+            growFrame(*c.fn, base);
+            tailCallee = c.fn;
+        } else if (auto v = dynamic_cast<const VarExpr*>(stmt.expr.get()); v && v->slot >= 0) {
+            returnValue = move(stack[frameBase + v->slot]); // the frame is about to go
+        } else {
+            returnValue = stmt.expr ? eval(stmt.expr) : Value();
+        }
+        returning = true;
+    }
+
+    // === Sorting and searching ===
+    Value& lookupArray(const string& name) {
+        Value* it = findVar(name);
+        if (!it) {
+            throw runtime_error("Undefined array: " + name);
+        }
+        if (!isScalarArray(*it) && !holds_alternative<NumArray>(*it) && !holds_alternative<SpillArray>(*it)) {
+            throw runtime_error("Variable " + name + " is not an array");
+        }
+        return *it;
+    }
+
+    // NaN sorts after every number
+    static bool numLess(double a, double b) { return a < b || (b != b && a == a); }
+
+    // Order used by sort and search: numbers by value, then strings bytewise
+    static bool scalarLess(const Scalar& a, const Scalar& b) {
+        auto as = get_if<string>(&a);
+        auto bs = get_if<string>(&b);
+        if (as || bs) {
+            if (!as) return true;
+            if (!bs) return false;
+            return *as < *bs;
+        }
+        auto ai = get_if<int64_t>(&a);
+        auto bi = get_if<int64_t>(&b);
+        if (ai && bi) return *ai < *bi;
+        if (ai) return intLess(*ai, get<double>(b));
+        if (bi) return doubleLess(get<double>(a), *bi);
+        return numLess(get<double>(a), get<double>(b));
+    }
+
+    // Exact int/double comparisons: converting a large int to double rounds it, and
+    // the rounded order is not a strict weak ordering. Inside the int64 range the
+    // double's integer part is compared as an int and its fraction breaks the tie
+    static bool intLess(int64_t i, double d) {
+        if (d != d) return true;
+        if (d >= 9223372036854775808.0) return true;
+        if (d < -9223372036854775808.0) return false;
+        int64_t whole = (int64_t)d;
+        return i != whole ? i < whole : (double)whole < d;
+    }
+
+    static bool doubleLess(double d, int64_t i) {
+        if (d != d) return false;
+        if (d >= 9223372036854775808.0) return false;
+        if (d < -9223372036854775808.0) return true;
+        int64_t whole = (int64_t)d;
+        return whole != i ? whole < i : d < (double)whole;
+    }
+
+    // Sort chunks on separate threads, then merge neighbouring runs pairwise
+    template <typename T, typename Less>
+    static void parallelSort(vector<T>& items, Less less) {
+        const size_t minChunk = 1 << 16;
+        size_t threads = max<size_t>(1, min<size_t>(thread::hardware_concurrency(), items.size() / minChunk));
+        if (threads == 1) {
+            sort(items.begin(), items.end(), less);
+            return;
+        }
+
+        vector<size_t> bounds;
+        for (size_t i = 0; i <= threads; ++i) bounds.push_back(items.size() * i / threads);
+        vector<thread> pool;
+        for (size_t c = 0; c < threads; ++c) {
+            pool.emplace_back([&items, &less, b = bounds[c], e = bounds[c + 1]] {
+                sort(items.begin() + b, items.begin() + e, less);
+            });
+        }
+        for (auto& t : pool) t.join();
+
+        while (bounds.size() > 2) {
+            vector<size_t> next{0};
+            pool.clear();
+            for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+                pool.emplace_back([&items, &less, b = bounds[i], m = bounds[i + 1], e = bounds[i + 2]] {
+                    inplace_merge(items.begin() + b, items.begin() + m, items.begin() + e, less);
+                });
+                next.push_back(bounds[i + 2]);
+            }
+            if ((bounds.size() - 1) % 2 == 1) next.push_back(bounds.back()); // odd run waits a round
+            for (auto& t : pool) t.join();
+            bounds = move(next);
+        }
+    }
+
+    void execSort(const shared_ptr<SortStmt>& stmt) {
+        Value& arr = lookupArray(stmt->arrayName);
+        if (auto nums = get_if<NumArray>(&arr)) {
+            if (stmt->descending) parallelSort(*nums, [](double a, double b) { return numLess(b, a); });
+            else parallelSort(*nums, [](double a, double b) { return numLess(a, b); });
+            return;
+        }
+        auto& items = ownArray(arr);
+
+        // Lines from read : are all strings. Sort (prefix, index) keys instead: most
+        // comparisons are decided by the first 8 bytes without touching the strings
+        if (all_of(items.begin(), items.end(), [](const Scalar& s) { return holds_alternative<string>(s); })) {
+            struct Keyed {
+                uint64_t prefix; // first 8 bytes, big-endian, zero padded
+                size_t index;
+            };
+            vector<Keyed> keys(items.size());
+            for (size_t i = 0; i < items.size(); ++i) {
+                const string& text = get<string>(items[i]);
+                uint64_t prefix = 0;
+                for (size_t b = 0; b < 8; ++b) {
+                    prefix = (prefix << 8) | (b < text.size() ? (unsigned char)text[b] : 0);
+                }
+                keys[i] = {prefix, i};
+            }
+            auto less = [&items](const Keyed& a, const Keyed& b) {
+                if (a.prefix != b.prefix) return a.prefix < b.prefix;
+                return get<string>(items[a.index]) < get<string>(items[b.index]);
+            };
+            if (stmt->descending) parallelSort(keys, [&less](const Keyed& a, const Keyed& b) { return less(b, a); });
+            else parallelSort(keys, less);
+
+            // Apply the permutation in place, one cycle at a time
+            for (size_t i = 0; i < keys.size(); ++i) {
+                if (keys[i].index == i) continue;
+                Scalar held = move(items[i]);
+                size_t at = i;
+                while (keys[at].index != i) {
+                    size_t from = keys[at].index;
+                    items[at] = move(items[from]);
+                    keys[at].index = at;
+                    at = from;
+                }
+                items[at] = move(held);
+                keys[at].index = at;
+            }
+            return;
+        }
+        if (stmt->descending) parallelSort(items, [](const Scalar& a, const Scalar& b) { return scalarLess(b, a); });
+        else parallelSort(items, [](const Scalar& a, const Scalar& b) { return scalarLess(a, b); });
+    }
+
+    Scalar evalNeedle(const ExprPtr& expr) {
+        auto val = eval(expr);
+        if (!isScalar(val)) {
+            throw runtime_error("Cannot search an array for an array or map");
+        }
+        return toScalar(move(val));
+    }
+
+    // Index of an element equal to needle, by binary search (array sorted ascending) or a linear scan
+    static int64_t indexOf(const Value& arr, const Scalar& needle, bool binary) {
+        if (auto nums = get_if<NumArray>(&arr)) {
+            if (holds_alternative<string>(needle)) return -1;
+            double x = holds_alternative<int64_t>(needle) ? (double)get<int64_t>(needle) : get<double>(needle);
+            auto at = binary ? lower_bound(nums->begin(), nums->end(), x, numLess)
+                             : std::find(nums->begin(), nums->end(), x);
+            return (at != nums->end() && *at == x) ? at - nums->begin() : -1;
+        }
+        if (auto spilled = get_if<SpillArray>(&arr)) {
+            auto same = [&needle](const Scalar& s) { return !scalarLess(s, needle) && !scalarLess(needle, s); };
+            size_t lo = 0, hi = spilled->size();
+            if (binary) {
+                while (lo < hi) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (scalarLess(spilled->at(mid), needle)) lo = mid + 1;
+                    else hi = mid;
+                }
+                return (lo < spilled->size() && same(spilled->at(lo))) ? (int64_t)lo : -1;
+            }
+            for (; lo < hi; ++lo) {
+                if (same(spilled->at(lo))) return (int64_t)lo;
+            }
+            return -1;
+        }
+        ScalarSpan items = scalarsOf(arr);
+        auto same = [&needle](const Scalar& s) { return !scalarLess(s, needle) && !scalarLess(needle, s); };
+        auto at = binary ? lower_bound(items.begin(), items.end(), needle, scalarLess)
+                         : find_if(items.begin(), items.end(), same);
+        return (at != items.end() && same(*at)) ? at - items.begin() : -1;
+    }
+
+    void execSearch(const shared_ptr<SearchStmt>& stmt) {
+        Scalar needle = evalNeedle(stmt->value);
+        setVar(stmt->varName, indexOf(lookupArray(stmt->arrayName), needle, true));
+    }
+
+    // === String built-ins ===
+    // Text of an argument; string variables and literals are used in place
+    const string& textOf(const ExprPtr& expr, string& holder) {
+        if (auto s = dynamic_cast<const StringExpr*>(expr.get())) return s->value;
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            Value* it = findVar(*v);
+            if (it) {
+                if (auto str = get_if<string>(it)) return *str;
+            }
+        }
+        auto val = eval(expr);
+        if (!isScalar(val)) {
+            throw runtime_error("Expected a string, got an array or map");
+        }
+        holder = toString(val);
+        return holder;
+    }
+
+    // Array named by an argument, without copying it; nullptr if it is not an array variable
+    const Value* arrayOf(const ExprPtr& expr) {
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            Value* it = findVar(*v);
+            if (it && (isScalarArray(*it) || holds_alternative<NumArray>(*it) || holds_alternative<SpillArray>(*it))) {
+                return it;
+            }
+        }
+        return nullptr;
+    }
+
+    static size_t findText(const string& text, const string& needle, size_t from = 0) {
+        if (from > text.size()) return string::npos;
+        const char* hit = scanKernels().findSubstring(text.data() + from, text.data() + text.size(),
+                                                      needle.data(), needle.size());
+        return hit ? hit - text.data() : string::npos;
+    }
+
+    // An empty separator splits on runs of whitespace and drops empty parts
+    static vector<Scalar> splitText(const string& text, const string& sep) {
+        vector<Scalar> parts;
+        const char* p = text.data();
+        const char* end = p + text.size();
+        if (sep.empty()) {
+            const ScanKernels& scan = scanKernels();
+            while ((p = scan.skipSpace(p, end)) < end) {
+                const char* q = p;
+                while (q < end && !isSpaceByte(*q)) q++;
+                parts.emplace_back(string(p, q));
+                p = q;
+            }
+            return parts;
+        }
+        const ScanKernels& scan = scanKernels();
+        while (true) {
+            const char* hit = scan.findSubstring(p, end, sep.data(), sep.size());
+            if (!hit) break;
+            parts.emplace_back(string(p, hit));
+            p = hit + sep.size();
+        }
+        parts.emplace_back(string(p, end));
+        return parts;
+    }
+
+    static string joinArray(const Value& arr, const string& sep) {
+        string result;
+        if (auto nums = get_if<NumArray>(&arr)) {
+            for (size_t i = 0; i < nums->size(); ++i) {
+                if (i > 0) result += sep;
+                result += numberToString((*nums)[i]);
+            }
+            return result;
+        }
+        if (auto spilled = get_if<SpillArray>(&arr)) {
+            bool first = true;
+            spilled->forEach([&](const Scalar& s) {
+                if (!first) result += sep;
+                first = false;
+                if (auto str = get_if<string>(&s)) result += *str;
+                else result += scalarToString(s);
+            });
+            return result;
+        }
+        ScalarSpan items = scalarsOf(arr);
+        size_t total = 0;
+        for (auto& s : items) total += holds_alternative<string>(s) ? get<string>(s).size() + sep.size() : 24;
+        result.reserve(total);
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (i > 0) result += sep;
+            if (auto str = get_if<string>(&items[i])) result += *str;
+            else result += scalarToString(items[i]);
+        }
+        return result;
+    }
+
+    static string replaceText(const string& text, const string& from, const string& to) {
+        if (from.empty()) {
+            throw runtime_error("replace : needs a non-empty string to replace");
+        }
+        string result;
+        size_t at = 0;
+        while (true) {
+            size_t hit = findText(text, from, at);
+            if (hit == string::npos) break;
+            result.append(text, at, hit - at);
+            result += to;
+            at = hit + from.size();
+        }
+        if (at == 0) return text;
+        result.append(text, at, string::npos);
+        return result;
+    }
+
+    void execStringOp(const shared_ptr<StringOpStmt>& stmt) {
+        auto& args = stmt->args;
+        string h0, h1, h2;
+        switch (stmt->op) {
+            case StringOp::SPLIT:
+                setVar(stmt->varName, splitText(textOf(args[0], h0), textOf(args[1], h1)));
+                return;
+            case StringOp::JOIN: {
+                const Value* arr = arrayOf(args[0]);
+                Value holder;
+                if (!arr) {
+                    holder = eval(args[0]);
+                    if (!isScalarArray(holder) && !holds_alternative<NumArray>(holder) && !holds_alternative<SpillArray>(holder)) {
+                        throw runtime_error("join : needs an array on line " + to_string(stmt->line));
+                    }
+                    arr = &holder;
+                }
+                setVar(stmt->varName, joinArray(*arr, textOf(args[1], h1)));
+                return;
+            }
+            case StringOp::SUBSTR: {
+                const string& text = textOf(args[0], h0);
+                int64_t start = evalInt(args[1]);
+                int64_t length = evalInt(args[2]);
+                if (start < 0 || (size_t)start > text.size()) {
+                    throw runtime_error("substr start " + to_string(start) + " out of range for a string of length " +
+                                        to_string(text.size()));
+                }
+                if (length < 0) {
+                    throw runtime_error("substr length must not be negative");
+                }
+                setVar(stmt->varName, text.substr((size_t)start, (size_t)length));
+                return;
+            }
+            case StringOp::FIND: {
+                // On an array: index of the element; on a string: position of the substring
+                if (const Value* arr = arrayOf(args[0])) {
+                    setVar(stmt->varName, indexOf(*arr, evalNeedle(args[1]), false));
+                    return;
+                }
+                size_t at = findText(textOf(args[0], h0), textOf(args[1], h1));
+                setVar(stmt->varName, at == string::npos ? (int64_t)-1 : (int64_t)at);
+                return;
+            }
+            case StringOp::CONTAINS:
+                setVar(stmt->varName, (int64_t)(findText(textOf(args[0], h0), textOf(args[1], h1)) != string::npos));
+                return;
+            case StringOp::REPLACE:
+                setVar(stmt->varName, replaceText(textOf(args[0], h0), textOf(args[1], h1), textOf(args[2], h2)));
+                return;
+            case StringOp::TRIM: {
+                const string& text = textOf(args[0], h0);
+                const char* begin = scanKernels().skipSpace(text.data(), text.data() + text.size());
+                const char* end = text.data() + text.size();
+                while (end > begin && isSpaceByte(end[-1])) end--;
+                setVar(stmt->varName, string(begin, end));
+                return;
+            }
+            case StringOp::UPPER:
+            case StringOp::LOWER: {
+                string text = textOf(args[0], h0);
+                // ASCII only; a branch-free loop the compiler vectorizes
+                unsigned char from = stmt->op == StringOp::UPPER ? 'a' : 'A';
+                for (char& c : text) c ^= (char)(((unsigned char)(c - from) < 26) << 5);
+                setVar(stmt->varName, move(text));
+                return;
+            }
+        }
+    }
+
+    // === Value helpers ===
+    static Value fromScalar(const Scalar& s) {
+        if (holds_alternative<int64_t>(s)) return get<int64_t>(s);
+        if (holds_alternative<double>(s)) return get<double>(s);
+        return get<string>(s);
+    }
+
+    static bool isScalar(const Value& v) {
+        return holds_alternative<int64_t>(v) || holds_alternative<double>(v) || holds_alternative<string>(v);
+    }
+
+    static vector<Scalar> toGeneralArray(const NumArray& nums) {
+        return vector<Scalar>(nums.begin(), nums.end());
+    }
+
+    static Scalar toScalar(Value&& v) {
+        if (holds_alternative<int64_t>(v)) return get<int64_t>(v);
+        if (holds_alternative<double>(v)) return get<double>(v);
+        if (holds_alternative<string>(v)) return move(get<string>(v));
+        throw runtime_error("Cannot store an array or map inside an array");
+    }
+
+    // arr[a:b] shares the array's storage; dense number and spilled arrays copy the range
+    Value evalSlice(const SliceExpr& sl) {
+        Value* it = findVar(sl.arrayName);
+        if (!it) {
+            throw runtime_error("Undefined array: " + sl.arrayName);
+        }
+        size_t size;
+        if (auto nums = get_if<NumArray>(it)) size = nums->size();
+        else if (auto spilled = get_if<SpillArray>(it)) size = spilled->size();
+        else if (isScalarArray(*it)) size = scalarsOf(*it).size();
+        else throw runtime_error("Variable " + sl.arrayName + " is not an array");
+
+        // Bounds may equal the size, so a slice can end at the end or be empty
+        size_t from = sl.from ? toIndex(eval(sl.from), size + 1) : 0;
+        size_t to = sl.to ? toIndex(eval(sl.to), size + 1) : size;
+        if (from > to) {
+            throw runtime_error("Slice start " + to_string(from) + " is past its end " + to_string(to));
+        }
+
+        // Re-find: the bounds may have sliced this array already
+        Value& arr = *findVar(sl.arrayName);
+        if (auto nums = get_if<NumArray>(&arr)) {
+            return NumArray(nums->begin() + from, nums->begin() + to);
+        }
+        if (auto spilled = get_if<SpillArray>(&arr)) {
+            vector<Scalar> part;
+            part.reserve(to - from);
+            for (size_t i = from; i < to; ++i) part.push_back(spilled->at(i));
+            return part;
+        }
+        if (auto vec = get_if<vector<Scalar>>(&arr)) {
+            auto base = make_shared<vector<Scalar>>(move(*vec));
+            arr = ArraySlice{base, 0, base->size()};
+        }
+        auto& whole = get<ArraySlice>(arr);
+        return ArraySlice{whole.base, whole.begin + from, whole.begin + to};
+    }
+
+    // Ints index directly; floats are truncated like before
+    static size_t toIndex(const Value& v, size_t size) {
+        int64_t index;
+        if (holds_alternative<int64_t>(v)) {
+            index = get<int64_t>(v);
+        } else if (holds_alternative<double>(v)) {
+            index = doubleToInt(get<double>(v));
+        } else {
+            throw runtime_error("Array index must be a number");
+        }
+        if (index < 0 || (uint64_t)index >= size) {
+            throw runtime_error("Array index out of bounds: " + to_string(index));
+        }
+        return (size_t)index;
+    }
+
+    static int64_t doubleToInt(double d) {
+        // 2^63 is exactly representable; anything outside [-2^63, 2^63) has no int64 value
+        if (!(d >= -9223372036854775808.0 && d < 9223372036854775808.0)) {
+            throw runtime_error("Number out of int range: " + to_string(d));
+        }
+        return (int64_t)d;
+    }
+
+    // Convert a value to the declared numeric type of its variable. Strings that
+    // spell a number of that type are parsed; false if the value is no number at all
+    static bool coerce(Value& v, StaticType target) {
+        if (target == StaticType::INT && holds_alternative<double>(v)) {
+            v = doubleToInt(get<double>(v));
+        } else if (target == StaticType::FLOAT && holds_alternative<int64_t>(v)) {
+            v = (double)get<int64_t>(v);
+        } else if (auto s = get_if<string>(&v); s && target != StaticType::DYNAMIC) {
+            const char* first = s->data();
+            const char* last = first + s->size();
+            if (target == StaticType::INT) {
+                int64_t i;
+                auto res = from_chars(first, last, i);
+                if (res.ec != errc() || res.ptr != last) return false;
+                v = i;
+            } else {
+                double d;
+                auto res = from_chars(first, last, d);
+                if (res.ec != errc() || res.ptr != last) return false;
+                v = d;
+            }
+        }
+        return target == StaticType::DYNAMIC || isNumber(v);
+    }
+
+    // Script-level name of a value's type, as the type checker spells it
+    static const char* kindName(const Value& v) {
+        if (holds_alternative<int64_t>(v)) return "int";
+        if (holds_alternative<double>(v)) return "float";
+        if (holds_alternative<string>(v)) return "str";
+        if (holds_alternative<HashMap>(v)) return "map";
+        return "array";
+    }
+
+    static bool isNumber(const Value& v) {
+        return holds_alternative<int64_t>(v) || holds_alternative<double>(v);
+    }
+
+    static double asDouble(const Value& v) {
+        if (holds_alternative<int64_t>(v)) return (double)get<int64_t>(v);
+        return get<double>(v);
+    }
+
+    // Two's-complement wrapping integer arithmetic, never undefined behaviour
+    static int64_t intAdd(int64_t a, int64_t b) { return (int64_t)((uint64_t)a + (uint64_t)b); }
+    static int64_t intSub(int64_t a, int64_t b) { return (int64_t)((uint64_t)a - (uint64_t)b); }
+    static int64_t intMul(int64_t a, int64_t b) { return (int64_t)((uint64_t)a * (uint64_t)b); }
+    static int64_t intDiv(int64_t a, int64_t b) {
+        if (b == 0) throw runtime_error("Integer division by zero");
+        if (b == -1) return intSub(0, a); // INT64_MIN / -1 overflows
+        return a / b;
+    }
+
+    static Value boolValue(bool b) { return (int64_t)(b ? 1 : 0); }
+
+    // === Expression Evaluation ===
+    Value eval(const ExprPtr& expr) {
+        if (auto n = dynamic_pointer_cast<NumberExpr>(expr)) {
+            if (n->isInt) return n->intValue;
+            return n->value;
+        }
+        if (auto s = dynamic_pointer_cast<StringExpr>(expr)) {
+            return s->value;
+        }
+        if (auto a = dynamic_pointer_cast<ArrayExpr>(expr)) {
+            vector<Scalar> values;
+            for (auto& v : a->values) {
+                auto result = eval(v);
+                if (!isScalar(result)) {
+                    // For nested arrays, we could either flatten them or convert to string
+                    // For simplicity, let's convert nested arrays to string representation
+                    values.push_back(toString(result));
+                } else {
+                    values.push_back(toScalar(move(result)));
+                }
+            }
+            return values;
+        }
+        if (dynamic_pointer_cast<MapExpr>(expr)) {
+            return HashMap();
+        }
+        if (auto aa = dynamic_pointer_cast<ArrayAccessExpr>(expr)) {
+            // Find the array variable
+            Value* it = findVar(aa->arrayName);
+            if (!it) {
+                throw runtime_error("Undefined array: " + aa->arrayName);
+            }
+            
+            if (auto nums = get_if<NumArray>(it)) {
+                return (*nums)[toIndex(eval(aa->index), nums->size())];
+            }
+            if (auto spilled = get_if<SpillArray>(it)) {
+                return fromScalar(spilled->at(toIndex(eval(aa->index), spilled->size())));
+            }
+
+            // Make sure it's actually an array
+            if (!isScalarArray(*it)) {
+                throw runtime_error("Variable " + aa->arrayName + " is not an array");
+            }
+            
+            ScalarSpan array = scalarsOf(*it);
+            size_t index = toIndex(eval(aa->index), array.size());
+            return fromScalar(array[index]);
+        }
+        if (auto sl = dynamic_pointer_cast<SliceExpr>(expr)) {
+            return evalSlice(*sl);
+        }
+        if (auto v = dynamic_pointer_cast<VarExpr>(expr)) {
+            // STRICT LOOKUP: do not default-initialize missing variables
+            Value* it = findVar(*v);
+            if (!it) {
+                throw runtime_error("Undefined variable: " + v->name);
+            }
+            return *it;
+        }
+        if (auto c = dynamic_cast<const CallExpr*>(expr.get())) {
+            return call(*c);
+        }
+        if (auto b = dynamic_pointer_cast<BinaryExpr>(expr)) {
+            // Operand types proven by the TypeChecker: skip guards and intermediate variants
+            if (b->proven) {
+                b->hit();
+                if (b->quick == QuickKind::CONCAT) {
+                    // Build the whole chain in scratch memory; only the result escapes
+                    pmr::string text(&arena);
+                    appendText(b->left, text);
+                    appendText(b->right, text);
+                    return string(text);
+                }
+                if (isFloatArith(b->quick)) return evalProvenDouble(*b);
+                return evalProvenInt(*b);
+            }
+
+            // Specialized string comparisons read literals and variables in place
+            bool compared;
+            if (isStringCompare(b->quick) && compareText(*b, compared)) {
+                b->hit();
+                return boolValue(compared);
+            }
+
+            auto left = eval(b->left);
+            auto right = eval(b->right);
+
+            // Fast path: the node has already been specialized for a type combination
+            if (b->quick != QuickKind::UNQUICKENED && b->quick != QuickKind::GENERIC) {
+                Value result;
+                if (evalQuick(*b, left, right, result)) {
+                    b->hit();
+                    return result;
+                }
+                // Guard failed: deoptimize, and give up on specializing after too many misses
+                size_t misses = b->misses.fetch_add(1, memory_order_relaxed) + 1;
+                b->quick = (misses >= MAX_QUICK_MISSES) ? QuickKind::GENERIC : QuickKind::UNQUICKENED;
+            }
+            if (b->quick == QuickKind::UNQUICKENED) {
+                b->quick = quicken(b->op, left, right);
+            }
+            return evalBinaryGeneric(b->op, left, right);
+        }
+        return 0.0; // fallback
+    }
+
+    // === Quickening ===
+    static constexpr size_t MAX_QUICK_MISSES = 4;
+
+    static bool isFloatArith(QuickKind k) {
+        return k == QuickKind::NUM_ADD || k == QuickKind::NUM_SUB || k == QuickKind::NUM_MUL || k == QuickKind::NUM_DIV;
+    }
+
+    // Pick the specialized form for this operator and operand types
+    static QuickKind quicken(const string& op, const Value& left,
+                             const Value& right) {
+        if (holds_alternative<int64_t>(left) && holds_alternative<int64_t>(right)) {
+            if (op == "+") return QuickKind::INT_ADD;
+            if (op == "-") return QuickKind::INT_SUB;
+            if (op == "*") return QuickKind::INT_MUL;
+            if (op == "/") return QuickKind::INT_DIV;
+            if (op == "<") return QuickKind::INT_LT;
+            if (op == ">") return QuickKind::INT_GT;
+            if (op == "<=") return QuickKind::INT_LE;
+            if (op == ">=") return QuickKind::INT_GE;
+            if (op == "==") return QuickKind::INT_EQ;
+            if (op == "!=") return QuickKind::INT_NE;
+        }
+        if (isNumber(left) && isNumber(right)) {
+            if (op == "+") return QuickKind::NUM_ADD;
+            if (op == "-") return QuickKind::NUM_SUB;
+            if (op == "*") return QuickKind::NUM_MUL;
+            if (op == "/") return QuickKind::NUM_DIV;
+            if (op == "<") return QuickKind::NUM_LT;
+            if (op == ">") return QuickKind::NUM_GT;
+            if (op == "<=") return QuickKind::NUM_LE;
+            if (op == ">=") return QuickKind::NUM_GE;
+            if (op == "==") return QuickKind::NUM_EQ;
+            if (op == "!=") return QuickKind::NUM_NE;
+        }
+        if (holds_alternative<string>(left) && holds_alternative<string>(right)) {
+            if (op == "==") return QuickKind::STR_EQ;
+            if (op == "!=") return QuickKind::STR_NE;
+            if (op == "<") return QuickKind::STR_LT;
+            if (op == ">") return QuickKind::STR_GT;
+            if (op == "<=") return QuickKind::STR_LE;
+            if (op == ">=") return QuickKind::STR_GE;
+        }
+        if (op == "+") return QuickKind::CONCAT;
+        return QuickKind::GENERIC;
+    }
+
+    // Run the specialized form; returns false if the type guard fails
+    bool evalQuick(const BinaryExpr& b, const Value& left,
+                   const Value& right,
+                   Value& out) {
+        switch (b.quick) {
+            case QuickKind::INT_ADD: case QuickKind::INT_SUB: case QuickKind::INT_MUL: case QuickKind::INT_DIV:
+            case QuickKind::INT_LT: case QuickKind::INT_GT: case QuickKind::INT_LE: case QuickKind::INT_GE:
+            case QuickKind::INT_EQ: case QuickKind::INT_NE: {
+                auto l = get_if<int64_t>(&left);
+                auto r = get_if<int64_t>(&right);
+                if (!l || !r) return false;
+                out = intOp(b.quick, *l, *r);
+                return true;
+            }
+            case QuickKind::NUM_ADD: case QuickKind::NUM_SUB: case QuickKind::NUM_MUL: case QuickKind::NUM_DIV:
+            case QuickKind::NUM_LT: case QuickKind::NUM_GT: case QuickKind::NUM_LE: case QuickKind::NUM_GE:
+            case QuickKind::NUM_EQ: case QuickKind::NUM_NE: {
+                // int op int must stay integer arithmetic, so that combination fails the guard
+                if (!isNumber(left) || !isNumber(right) ||
+                    (holds_alternative<int64_t>(left) && holds_alternative<int64_t>(right))) return false;
+                double l = asDouble(left);
+                double r = asDouble(right);
+                switch (b.quick) {
+                    case QuickKind::NUM_ADD: out = l + r; break;
+                    case QuickKind::NUM_SUB: out = l - r; break;
+                    case QuickKind::NUM_MUL: out = l * r; break;
+                    case QuickKind::NUM_DIV: out = l / r; break;
+                    case QuickKind::NUM_LT: out = boolValue(l < r); break;
+                    case QuickKind::NUM_GT: out = boolValue(l > r); break;
+                    case QuickKind::NUM_LE: out = boolValue(l <= r); break;
+                    case QuickKind::NUM_GE: out = boolValue(l >= r); break;
+                    case QuickKind::NUM_EQ: out = boolValue(l == r); break;
+                    default: out = boolValue(l != r); break;
+                }
+                return true;
+            }
+            case QuickKind::STR_EQ: case QuickKind::STR_NE: case QuickKind::STR_LT:
+            case QuickKind::STR_GT: case QuickKind::STR_LE: case QuickKind::STR_GE: {
+                auto l = get_if<string>(&left);
+                auto r = get_if<string>(&right);
+                if (!l || !r) return false;
+                out = boolValue(strOp(b.quick, *l, *r));
+                return true;
+            }
+            case QuickKind::CONCAT: {
+                // number + number must stay an addition, so that combination fails the guard
+                if (isNumber(left) && isNumber(right)) return false;
+                out = toString(left) + toString(right);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    static int64_t intOp(QuickKind k, int64_t l, int64_t r) {
+        switch (k) {
+            case QuickKind::INT_ADD: return intAdd(l, r);
+            case QuickKind::INT_SUB: return intSub(l, r);
+            case QuickKind::INT_MUL: return intMul(l, r);
+            case QuickKind::INT_DIV: return intDiv(l, r);
+            case QuickKind::INT_LT: return l < r;
+            case QuickKind::INT_GT: return l > r;
+            case QuickKind::INT_LE: return l <= r;
+            case QuickKind::INT_GE: return l >= r;
+            case QuickKind::INT_EQ: return l == r;
+            default: return l != r;
+        }
+    }
+
+    static bool strOp(QuickKind k, const string& l, const string& r) {
+        switch (k) {
+            case QuickKind::STR_EQ: return &l == &r || l == r; // interned constants: one compare
+            case QuickKind::STR_NE: return &l != &r && l != r;
+            case QuickKind::STR_LT: return l < r;
+            case QuickKind::STR_GT: return l > r;
+            case QuickKind::STR_LE: return l <= r;
+            default: return l >= r;
+        }
+    }
+
+    // Evaluate an expression the TypeChecker proved int on plain int64s
+    int64_t evalInt(const ExprPtr& expr) {
+        if (auto n = dynamic_cast<const NumberExpr*>(expr.get())) {
+            if (n->isInt) return n->intValue;
+        }
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) {
+            if (b->proven && b->quick != QuickKind::CONCAT && !isFloatArith(b->quick)) {
+                b->hit();
+                return evalProvenInt(*b);
+            }
+        }
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            Value* it = findVar(*v);
+            if (!it) {
+                throw runtime_error("Undefined variable: " + v->name);
+            }
+            if (auto i = get_if<int64_t>(it)) return *i;
+            throw runtime_error("Variable " + v->name + " does not hold an int");
+        }
+        auto val = eval(expr);
+        if (auto i = get_if<int64_t>(&val)) return *i;
+        throw runtime_error("Expected an int");
+    }
+
+    // Evaluate an expression the TypeChecker proved numeric on plain doubles
+    double evalNumber(const ExprPtr& expr) {
+        if (auto n = dynamic_cast<const NumberExpr*>(expr.get())) {
+            return n->value;
+        }
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) {
+            if (b->proven && b->quick != QuickKind::CONCAT) {
+                b->hit();
+                if (isFloatArith(b->quick)) return evalProvenDouble(*b);
+                return (double)evalProvenInt(*b);
+            }
+        }
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            Value* it = findVar(*v);
+            if (!it) {
+                throw runtime_error("Undefined variable: " + v->name);
+            }
+            if (isNumber(*it)) return asDouble(*it);
+            throw runtime_error("Variable " + v->name + " does not hold a number");
+        }
+        auto val = eval(expr);
+        if (isNumber(val)) return asDouble(val);
+        throw runtime_error("Expected a number");
+    }
+
+    // Float arithmetic of a proven node
+    double evalProvenDouble(BinaryExpr& b) {
+        double l = evalNumber(b.left);
+        double r = evalNumber(b.right);
+        switch (b.quick) {
+            case QuickKind::NUM_ADD: return l + r;
+            case QuickKind::NUM_SUB: return l - r;
+            case QuickKind::NUM_MUL: return l * r;
+            default: return l / r;
+        }
+    }
+
+    // Int arithmetic or any comparison of a proven node; comparisons yield 1 or 0
+    int64_t evalProvenInt(BinaryExpr& b) {
+        switch (b.quick) {
+            case QuickKind::INT_ADD: case QuickKind::INT_SUB: case QuickKind::INT_MUL: case QuickKind::INT_DIV:
+            case QuickKind::INT_LT: case QuickKind::INT_GT: case QuickKind::INT_LE: case QuickKind::INT_GE:
+            case QuickKind::INT_EQ: case QuickKind::INT_NE: {
+                int64_t l = evalInt(b.left);
+                return intOp(b.quick, l, evalInt(b.right));
+            }
+            case QuickKind::NUM_LT: return evalNumber(b.left) < evalNumber(b.right);
+            case QuickKind::NUM_GT: return evalNumber(b.left) > evalNumber(b.right);
+            case QuickKind::NUM_LE: return evalNumber(b.left) <= evalNumber(b.right);
+            case QuickKind::NUM_GE: return evalNumber(b.left) >= evalNumber(b.right);
+            case QuickKind::NUM_EQ: return evalNumber(b.left) == evalNumber(b.right);
+            case QuickKind::NUM_NE: return evalNumber(b.left) != evalNumber(b.right);
+            default: break;
+        }
+        bool result;
+        if (compareText(b, result)) return result;
+        auto left = eval(b.left);
+        auto right = eval(b.right);
+        auto l = get_if<string>(&left);
+        auto r = get_if<string>(&right);
+        if (!l || !r) throw runtime_error("Expected strings on line " + to_string(b.line));
+        return strOp(b.quick, *l, *r);
+    }
+
+    // String held by a literal or a variable, without copying it; nullptr otherwise
+    const string* textIn(const ExprPtr& expr) {
+        if (auto s = dynamic_cast<const StringExpr*>(expr.get())) return &s->value;
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            if (Value* it = findVar(*v)) return get_if<string>(it);
+        }
+        return nullptr;
+    }
+
+    // String comparison of b on borrowed operands; false if either is not a string in place
+    bool compareText(const BinaryExpr& b, bool& result) {
+        const string* l = textIn(b.left);
+        const string* r = l ? textIn(b.right) : nullptr;
+        if (!r) return false;
+        result = strOp(b.quick, *l, *r);
+        return true;
+    }
+
+    static bool isStringCompare(QuickKind k) {
+        return k == QuickKind::STR_EQ || k == QuickKind::STR_NE || k == QuickKind::STR_LT ||
+               k == QuickKind::STR_GT || k == QuickKind::STR_LE || k == QuickKind::STR_GE;
+    }
+
+    // The original, unspecialized semantics of every binary operator
+    Value evalBinaryGeneric(const string& op,
+            const Value& left,
+            const Value& right) {
+        // integer arithmetic when both sides are ints
+        if (holds_alternative<int64_t>(left) && holds_alternative<int64_t>(right)) {
+            int64_t l = get<int64_t>(left);
+            int64_t r = get<int64_t>(right);
+            if (op == "+") return intAdd(l, r);
+            if (op == "-") return intSub(l, r);
+            if (op == "*") return intMul(l, r);
+            if (op == "/") return intDiv(l, r);
+            if (op == "<") return boolValue(l < r);
+            if (op == ">") return boolValue(l > r);
+            if (op == "==") return boolValue(l == r);
+            if (op == "<=") return boolValue(l <= r);
+            if (op == ">=") return boolValue(l >= r);
+            if (op == "!=") return boolValue(l != r);
+        }
+
+        // arithmetic on numbers
+        if (isNumber(left) && isNumber(right)) {
+            double l = asDouble(left);
+            double r = asDouble(right);
+            if (op == "+") return l + r;
+            if (op == "-") return l - r;
+            if (op == "*") return l * r;
+            if (op == "/") return l / r;
+            if (op == "<") return boolValue(l < r);
+            if (op == ">") return boolValue(l > r);
+            if (op == "==") return boolValue(l == r);
+            if (op == "<=") return boolValue(l <= r);
+            if (op == ">=") return boolValue(l >= r);
+            if (op == "!=") return boolValue(l != r);
+        }
+
+        // string comparisons
+        if (holds_alternative<string>(left) && holds_alternative<string>(right)) {
+            const string& l = get<string>(left);
+            const string& r = get<string>(right);
+            if (op == "==") return boolValue(l == r);
+            if (op == "!=") return boolValue(l != r);
+            if (op == "<") return boolValue(l < r);
+            if (op == ">") return boolValue(l > r);
+            if (op == "<=") return boolValue(l <= r);
+            if (op == ">=") return boolValue(l >= r);
+        }
+
+        // string concatenation with +
+        if (op == "+") {
+            string l = toString(left);
+            string r = toString(right);
+            return l + r;
+        }
+        return 0.0; // fallback
+    }
+
+    // Append an expression's text to a scratch buffer. Proven concatenation chains
+    // are flattened and variables and literals are read in place, without copies
+    void appendText(const ExprPtr& expr, pmr::string& text) {
+        if (auto b = dynamic_cast<BinaryExpr*>(expr.get())) {
+            if (b->proven && b->quick == QuickKind::CONCAT) {
+                b->hit();
+                appendText(b->left, text);
+                appendText(b->right, text);
+                return;
+            }
+        }
+        if (auto s = dynamic_cast<const StringExpr*>(expr.get())) {
+            text += s->value;
+            return;
+        }
+        if (auto v = dynamic_cast<const VarExpr*>(expr.get())) {
+            Value* it = findVar(*v);
+            if (!it) {
+                throw runtime_error("Undefined variable: " + v->name);
+            }
+            appendValue(*it, text);
+            return;
+        }
+        appendValue(eval(expr), text);
+    }
+
+    void appendValue(const Value& val, pmr::string& text) {
+        if (auto s = get_if<string>(&val)) {
+            text += *s;
+        } else if (auto i = get_if<int64_t>(&val)) {
+            char digits[24];
+            text.append(digits, to_chars(digits, digits + sizeof digits, *i).ptr);
+        } else {
+            text += toString(val);
+        }
+    }
+
+    static string numberToString(double num) {
+        // no decimals if whole number (and representable as an int64)
+        if (num == std::trunc(num) && num >= -9223372036854775808.0 && num < 9223372036854775808.0) {
+            return to_string((int64_t)num);
+        }
+        return to_string(num);
+    }
+
+    static string scalarToString(const Scalar& s) {
+        if (holds_alternative<int64_t>(s)) return to_string(get<int64_t>(s));
+        if (holds_alternative<double>(s)) return numberToString(get<double>(s));
+        return get<string>(s);
+    }
+
+    string toString(const Value& val) {
+        if (holds_alternative<int64_t>(val)) {
+            return to_string(get<int64_t>(val));
+        } else if (holds_alternative<double>(val)) {
+            return numberToString(get<double>(val));
+        } else if (holds_alternative<string>(val)) {
+            return get<string>(val);
+        } else if (isScalarArray(val)) {
+            string result = "[";
+            ScalarSpan arr = scalarsOf(val);
+            for (size_t i = 0; i < arr.size(); ++i) {
+                if (i > 0) result += ", ";
+                if (holds_alternative<int64_t>(arr[i])) {
+                    result += to_string(get<int64_t>(arr[i]));
+                } else if (holds_alternative<double>(arr[i])) {
+                    result += numberToString(get<double>(arr[i]));
+                } else {
+                    result += get<string>(arr[i]);
+                }
+            }
+            result += "]";
+            return result;
+        } else if (holds_alternative<NumArray>(val)) {
+            string result = "[";
+            auto& arr = get<NumArray>(val);
+            for (size_t i = 0; i < arr.size(); ++i) {
+                if (i > 0) result += ", ";
+                result += numberToString(arr[i]);
+            }
+            result += "]";
+            return result;
+        } else if (auto spilled = get_if<SpillArray>(&val)) {
+            string result = "[";
+            bool first = true;
+            spilled->forEach([&](const Scalar& s) {
+                if (!first) result += ", ";
+                first = false;
+                result += scalarToString(s);
+            });
+            result += "]";
+            return result;
+        } else if (holds_alternative<HashMap>(val)) {
+            string result = "{";
+            bool first = true;
+            get<HashMap>(val).forEach([&](const Scalar& k, const Scalar& v) {
+                if (!first) result += ", ";
+                first = false;
+                result += scalarToString(k) + ": " + scalarToString(v);
+            });
+            result += "}";
+            return result;
+        }
+        return "";
+    }
+};
+
+/* =====================
+   MODULES
+   - import : "file.spt" compiles a file of functions once per process
+   - compiled modules are cached by content hash and shared read-only by every
+     program and thread that imports them
+   - with --module-cache <dir> they are also kept on disk as .sprc images
+   ===================== */
+vector<StmtPtr> compileProgram(const string& source, bool typecheck, vector<string>& errors, const string& dir = ".");
+
+struct Module {
+    string path;
+    uint64_t hash = 0;      // of the source text
+    vector<StmtPtr> program; // func and import statements only
+    unordered_map<string, FuncStmt*> functions; // defined here, not re-exported imports
+};
+
+// FNV-1a, 64 bit
+static uint64_t contentHash(const string& text) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : text) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Compiled module image: "SPRC", format version, source hash, a checksum of the
+// rest, then the resolved and type-checked AST as tagged nodes. All integers are little-endian
+class ModuleWriter {
+    string out;
+
+public:
+    static constexpr uint32_t VERSION = 2;
+    static constexpr size_t HEADER = 24; // magic, version, source hash, checksum of the nodes
+
+    string write(const Module& m) {
+        out = "SPRC";
+        u32(VERSION);
+        u64(m.hash);
+        u64(0); // checksum, filled in below
+        stmts(m.program);
+        Checksum sum;
+        sum.update(out.data() + HEADER, out.size() - HEADER);
+        uint64_t digest = toLittleEndian(sum.digest());
+        memcpy(&out[HEADER - 8], &digest, 8);
+        return move(out);
+    }
+
+private:
+    void u8(uint8_t v) { out += (char)v; }
+    void u32(uint32_t v) {
+        for (int i = 0; i < 4; ++i) u8((uint8_t)(v >> (8 * i)));
+    }
+    void u64(uint64_t v) {
+        for (int i = 0; i < 8; ++i) u8((uint8_t)(v >> (8 * i)));
+    }
+    void i32(int v) { u32((uint32_t)v); }
+    void f64(double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof bits);
+        u64(bits);
+    }
+    void str(const string& s) {
+        u32((uint32_t)s.size());
+        out += s;
+    }
+
+    void exprs(const vector<ExprPtr>& list) {
+        u32((uint32_t)list.size());
+        for (auto& e : list) expr(e);
+    }
+
+    void stmts(const vector<StmtPtr>& list) {
+        u32((uint32_t)list.size());
+        for (auto& s : list) stmt(s);
+    }
+
+    void expr(const ExprPtr& node) {
+        Expr* e = node.get();
+        if (!e) {
+            u8(0);
+            return;
+        }
+        if (auto n = dynamic_cast<NumberExpr*>(e)) {
+            u8(1);
+            u8(n->isInt);
+            f64(n->value);
+            u64((uint64_t)n->intValue);
+        } else if (auto s = dynamic_cast<StringExpr*>(e)) {
+            u8(2);
+            str(s->value);
+        } else if (auto a = dynamic_cast<ArrayExpr*>(e)) {
+            u8(3);
+            exprs(a->values);
+        } else if (dynamic_cast<MapExpr*>(e)) {
+            u8(4);
+        } else if (auto aa = dynamic_cast<ArrayAccessExpr*>(e)) {
+            u8(5);
+            str(aa->arrayName);
+            expr(aa->index);
+        } else if (auto sl = dynamic_cast<SliceExpr*>(e)) {
+            u8(6);
+            str(sl->arrayName);
+            expr(sl->from);
+            expr(sl->to);
+        } else if (auto v = dynamic_cast<VarExpr*>(e)) {
+            u8(7);
+            str(v->name);
+            i32(v->slot);
+        } else if (auto c = dynamic_cast<CallExpr*>(e)) {
+            u8(8);
+            str(c->name);
+            exprs(c->args);
+            i32(c->line);
+        } else if (auto b = dynamic_cast<BinaryExpr*>(e)) {
+            u8(9);
+            str(b->op);
+            expr(b->left);
+            expr(b->right);
+            i32(b->line);
+            u8(b->proven);
+            u8((uint8_t)(b->proven ? b->quick.load() : QuickKind::UNQUICKENED)); // proven nodes are quickened by the checker
+        } else {
+            throw runtime_error("Cannot store expression in a module image");
+        }
+        u8((uint8_t)e->staticType);
+    }
+
+    void stmt(const StmtPtr& node) {
+        Stmt* st = node.get();
+        if (auto d = dynamic_cast<DeclStmt*>(st)) {
+            u8(1);
+            str(d->type);
+            str(d->name);
+            expr(d->init);
+            i32(d->slot);
+        } else if (auto ad = dynamic_cast<ArrayDeclStmt*>(st)) {
+            u8(2);
+            str(ad->name);
+            exprs(ad->values);
+            expr(ad->init);
+        } else if (auto a = dynamic_cast<AssignStmt*>(st)) {
+            u8(3);
+            str(a->name);
+            expr(a->expr);
+            u8((uint8_t)a->target);
+            i32(a->slot);
+        } else if (auto aa = dynamic_cast<ArrayAssignStmt*>(st)) {
+            u8(4);
+            str(aa->arrayName);
+            expr(aa->index);
+            expr(aa->expr);
+        } else if (auto p = dynamic_cast<PrintStmt*>(st)) {
+            u8(5);
+            expr(p->expr);
+        } else if (auto in = dynamic_cast<InputStmt*>(st)) {
+            u8(6);
+            str(in->name);
+            str(in->question);
+        } else if (auto r = dynamic_cast<RandomStmt*>(st)) {
+            u8(7);
+            str(r->name);
+            i32(r->min);
+            i32(r->max);
+        } else if (auto ifs = dynamic_cast<IfStmt*>(st)) {
+            u8(8);
+            u32((uint32_t)ifs->branches.size());
+            for (auto& branch : ifs->branches) {
+                expr(branch.first);
+                stmts(branch.second);
+            }
+        } else if (auto j = dynamic_cast<JumpStmt*>(st)) {
+            u8(9);
+            i32(j->jumpTo);
+        } else if (dynamic_cast<BreakStmt*>(st)) {
+            u8(10);
+        } else if (auto sl = dynamic_cast<SleepStmt*>(st)) {
+            u8(11);
+            expr(sl->millis);
+        } else if (dynamic_cast<YieldStmt*>(st)) {
+            u8(12);
+        } else if (auto rd = dynamic_cast<ReadStmt*>(st)) {
+            u8(13);
+            str(rd->varName);
+            str(rd->fileName);
+            u8(rd->numeric);
+        } else if (auto l = dynamic_cast<LengthStmt*>(st)) {
+            u8(14);
+            str(l->varName);
+            str(l->ArrayName);
+        } else if (auto w = dynamic_cast<WriteStmt*>(st)) {
+            u8(15);
+            str(w->ArrayName);
+            str(w->fileName);
+        } else if (auto mf = dynamic_cast<MakefileStmt*>(st)) {
+            u8(16);
+            str(mf->filename);
+        } else if (auto df = dynamic_cast<DelfileStmt*>(st)) {
+            u8(17);
+            str(df->filename);
+        } else if (auto e = dynamic_cast<EachStmt*>(st)) {
+            u8(18);
+            str(e->varName);
+            str(e->fileName);
+            i32(e->blockSize);
+            stmts(e->body);
+        } else if (auto mp = dynamic_cast<MapPutStmt*>(st)) {
+            u8(19);
+            str(mp->mapName);
+            expr(mp->key);
+            expr(mp->value);
+        } else if (auto mg = dynamic_cast<MapGetStmt*>(st)) {
+            u8(20);
+            str(mg->varName);
+            str(mg->mapName);
+            expr(mg->key);
+        } else if (auto md = dynamic_cast<MapDelStmt*>(st)) {
+            u8(21);
+            str(md->mapName);
+            expr(md->key);
+        } else if (auto mh = dynamic_cast<MapHasStmt*>(st)) {
+            u8(22);
+            str(mh->varName);
+            str(mh->mapName);
+            expr(mh->key);
+        } else if (auto so = dynamic_cast<SortStmt*>(st)) {
+            u8(23);
+            str(so->arrayName);
+            u8(so->descending);
+        } else if (auto se = dynamic_cast<SearchStmt*>(st)) {
+            u8(24);
+            str(se->varName);
+            str(se->arrayName);
+            expr(se->value);
+        } else if (auto op = dynamic_cast<StringOpStmt*>(st)) {
+            u8(25);
+            u8((uint8_t)op->op);
+            str(op->varName);
+            exprs(op->args);
+        } else if (auto f = dynamic_cast<FuncStmt*>(st)) {
+            u8(26);
+            str(f->name);
+            u32((uint32_t)f->params.size());
+            for (auto& p : f->params) str(p);
+            stmts(f->body);
+            u32((uint32_t)f->slots.size());
+            for (auto& [name, slot] : f->slots) {
+                str(name);
+                i32(slot);
+            }
+            u8(f->inlineBody != nullptr);
+        } else if (auto ret = dynamic_cast<ReturnStmt*>(st)) {
+            u8(27);
+            expr(ret->expr);
+            u8(ret->tail);
+        } else if (auto c = dynamic_cast<CallStmt*>(st)) {
+            u8(28);
+            expr(c->call);
+        } else if (auto imp = dynamic_cast<ImportStmt*>(st)) {
+            u8(29);
+            str(imp->fileName);
+            u64(imp->module->hash); // the image is only valid against this version of the import
+        } else {
+            throw runtime_error("Cannot store statement in a module image");
+        }
+        i32(st->line);
+    }
+};
+
+// Reads what ModuleWriter wrote; throws on anything malformed
+class ModuleReader {
+    const string& in;
+    size_t pos = 0;
+    bool inFunction = false;
+    int highestSlot = -1; // of the function being read
+
+public:
+    struct Import {
+        ImportStmt* stmt;
+        uint64_t hash;
+    };
+    vector<Import> imports;     // to be checked against the current imports
+    vector<CallExpr*> calls;    // to be linked once the functions are known
+    vector<FuncStmt*> functions;
+
+    explicit ModuleReader(const string& data) : in(data) {}
+
+    // Returns false if this is not an image of the given source hash
+    bool read(uint64_t hash, vector<StmtPtr>& program) {
+        if (in.compare(0, 4, "SPRC") != 0) return false;
+        pos = 4;
+        if (u32() != ModuleWriter::VERSION || u64() != hash) return false;
+        uint64_t stored = u64();
+        Checksum sum;
+        sum.update(in.data() + pos, in.size() - pos);
+        if (sum.digest() != stored) throw runtime_error("Module image checksum mismatch");
+        program = stmts();
+        if (pos != in.size()) throw runtime_error("Trailing bytes in module image");
+        return true;
+    }
+
+private:
+    void need(size_t n) {
+        if (in.size() - pos < n) throw runtime_error("Truncated module image");
+    }
+    uint8_t u8() {
+        need(1);
+        return (uint8_t)in[pos++];
+    }
+    uint32_t u32() {
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) v |= (uint32_t)u8() << (8 * i);
+        return v;
+    }
+    uint64_t u64() {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; ++i) v |= (uint64_t)u8() << (8 * i);
+        return v;
+    }
+    int i32() { return (int)u32(); }
+
+    // A frame slot: -1 outside functions; checked against the frame once the function's slots are read
+    int slot() {
+        int s = i32();
+        if (s < -1 || (s >= 0 && !inFunction)) throw runtime_error("Bad slot in module image");
+        highestSlot = max(highestSlot, s);
+        return s;
+    }
 
-    // Modified exec to return next statement index
-    size_t exec(const StmtPtr& stmt, const vector<StmtPtr>& program,
-                const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
-        if (auto d = dynamic_pointer_cast<DeclStmt>(stmt)) {
-            execDecl(d);
-            return currentIndex + 1;
+    // Enum bytes are range-checked so a damaged image cannot produce values the interpreter never handles
+    template <typename E>
+    E enumByte(E last) {
+        uint8_t v = u8();
+        if (v > (uint8_t)last) throw runtime_error("Bad enum value in module image");
+        return (E)v;
+    }
+
+    double f64() {
+        uint64_t bits = u64();
+        double v;
+        memcpy(&v, &bits, sizeof v);
+        return v;
+    }
+    string str() {
+        uint32_t n = u32();
+        need(n);
+        string s = in.substr(pos, n);
+        pos += n;
+        return s;
+    }
+    // Counts are checked against the bytes left so a corrupt image cannot ask for huge vectors
+    uint32_t count() {
+        uint32_t n = u32();
+        need(n);
+        return n;
+    }
+
+    vector<ExprPtr> exprs() {
+        vector<ExprPtr> list(count());
+        for (auto& e : list) e = expr();
+        return list;
+    }
+
+    vector<StmtPtr> stmts() {
+        vector<StmtPtr> list(count());
+        for (auto& s : list) s = stmt();
+        return list;
+    }
+
+    ExprPtr expr() {
+        ExprPtr e;
+        switch (u8()) {
+        case 0:
+            return nullptr;
+        case 1: {
+            bool isInt = u8();
+            double value = f64();
+            int64_t intValue = (int64_t)u64();
+            auto n = isInt ? make_shared<NumberExpr>(intValue) : make_shared<NumberExpr>(value);
+            e = n;
+            break;
         }
-        else if (auto a = dynamic_pointer_cast<AssignStmt>(stmt)) {
-            execAssign(a);
-            return currentIndex + 1;
+        case 2:
+            e = make_shared<StringExpr>(str());
+            break;
+        case 3:
+            e = make_shared<ArrayExpr>(exprs());
+            break;
+        case 4:
+            e = make_shared<MapExpr>();
+            break;
+        case 5: {
+            string name = str();
+            e = make_shared<ArrayAccessExpr>(move(name), expr());
+            break;
         }
-        else if (auto aa = dynamic_pointer_cast<ArrayAssignStmt>(stmt)) {
-            execArrayAssign(aa);
-            return currentIndex + 1;
+        case 6: {
+            string name = str();
+            ExprPtr from = expr();
+            e = make_shared<SliceExpr>(move(name), move(from), expr());
+            break;
         }
-        else if (auto p = dynamic_pointer_cast<PrintStmt>(stmt)) {
-            execPrint(p);
-            return currentIndex + 1;
+        case 7: {
+            auto v = make_shared<VarExpr>(str());
+            v->slot = slot();
+            e = v;
+            break;
         }
-        else if (auto i = dynamic_pointer_cast<InputStmt>(stmt)) {
-            execInput(i);
-            return currentIndex + 1;
+        case 8: {
+            string name = str();
+            vector<ExprPtr> args = exprs();
+            auto c = make_shared<CallExpr>(move(name), move(args), i32());
+            calls.push_back(c.get());
+            e = c;
+            break;
         }
-        else if (auto ifs = dynamic_pointer_cast<IfStmt>(stmt)) {
-            return execIf(ifs, program, lineToIndex, currentIndex);
+        case 9: {
+            string op = str();
+            ExprPtr left = expr();
+            ExprPtr right = expr();
+            auto b = make_shared<BinaryExpr>(move(op), move(left), move(right), i32());
+            b->proven = u8();
+            b->quick = enumByte(QuickKind::CONCAT);
+            e = b;
+            break;
         }
-        else if (auto j = dynamic_pointer_cast<JumpStmt>(stmt)) {
-            throw JumpException(j->jumpTo);
+        default:
+            throw runtime_error("Bad expression tag in module image");
         }
-        else if (auto b = dynamic_pointer_cast<BreakStmt>(stmt)) {
-            throw BreakException();
+        e->staticType = enumByte(StaticType::DYNAMIC);
+        return e;
+    }
+
+    StmtPtr stmt() {
+        StmtPtr s;
+        switch (u8()) {
+        case 1: {
+            string type = str(), name = str();
+            ExprPtr init = expr();
+            auto d = make_shared<DeclStmt>(move(type), move(name), move(init), 0);
+            d->slot = slot();
+            s = d;
+            break;
         }
-        else if (auto r = dynamic_pointer_cast<RandomStmt>(stmt)) {
-            execRandom(r);
-            return currentIndex + 1;
+        case 2: {
+            string name = str();
+            vector<ExprPtr> values = exprs();
+            auto ad = make_shared<ArrayDeclStmt>(move(name), expr(), 0);
+            ad->values = move(values);
+            s = ad;
+            break;
         }
-        else if (auto rd = dynamic_pointer_cast<ReadStmt>(stmt)) {
-            execRead(rd);
-            return currentIndex + 1;
+        case 3: {
+            string name = str();
+            auto a = make_shared<AssignStmt>(move(name), expr(), 0);
+            a->target = enumByte(StaticType::DYNAMIC);
+            a->slot = slot();
+            s = a;
+            break;
         }
-        else if (auto l = dynamic_pointer_cast<LengthStmt>(stmt)) {
-            execLength(l);
-            return currentIndex + 1;
+        case 4: {
+            string name = str();
+            ExprPtr index = expr();
+            s = make_shared<ArrayAssignStmt>(move(name), move(index), expr(), 0);
+            break;
         }
-        else if (auto w = dynamic_pointer_cast<WriteStmt>(stmt)) {
-            execWrite(w);
-            return currentIndex + 1;
+        case 5:
+            s = make_shared<PrintStmt>(expr(), 0);
+            break;
+        case 6: {
+            string name = str();
+            s = make_shared<InputStmt>(move(name), str(), 0);
+            break;
+        }
+        case 7: {
+            string name = str();
+            int min = i32();
+            s = make_shared<RandomStmt>(move(name), min, i32(), 0);
+            break;
+        }
+        case 8: {
+            auto ifs = make_shared<IfStmt>(0);
+            ifs->branches.resize(count());
+            for (auto& branch : ifs->branches) {
+                branch.first = expr();
+                branch.second = stmts();
+            }
+            s = ifs;
+            break;
+        }
+        case 9:
+            s = make_shared<JumpStmt>(i32(), 0);
+            break;
+        case 10:
+            s = make_shared<BreakStmt>(0);
+            break;
+        case 11:
+            s = make_shared<SleepStmt>(expr(), 0);
+            break;
+        case 12:
+            s = make_shared<YieldStmt>(0);
+            break;
+        case 13: {
+            string var = str(), file = str();
+            s = make_shared<ReadStmt>(move(var), move(file), 0, u8() != 0);
+            break;
+        }
+        case 14: {
+            string var = str();
+            s = make_shared<LengthStmt>(move(var), str(), 0);
+            break;
+        }
+        case 15: {
+            string arr = str();
+            s = make_shared<WriteStmt>(move(arr), str(), 0);
+            break;
+        }
+        case 16:
+            s = make_shared<MakefileStmt>(str(), 0);
+            break;
+        case 17:
+            s = make_shared<DelfileStmt>(str(), 0);
+            break;
+        case 18: {
+            string var = str(), file = str();
+            auto e = make_shared<EachStmt>(move(var), move(file), i32(), 0);
+            e->body = stmts();
+            s = e;
+            break;
+        }
+        case 19: {
+            string map = str();
+            ExprPtr key = expr();
+            s = make_shared<MapPutStmt>(move(map), move(key), expr(), 0);
+            break;
+        }
+        case 20: {
+            string var = str(), map = str();
+            s = make_shared<MapGetStmt>(move(var), move(map), expr(), 0);
+            break;
+        }
+        case 21: {
+            string map = str();
+            s = make_shared<MapDelStmt>(move(map), expr(), 0);
+            break;
+        }
+        case 22: {
+            string var = str(), map = str();
+            s = make_shared<MapHasStmt>(move(var), move(map), expr(), 0);
+            break;
+        }
+        case 23: {
+            string arr = str();
+            s = make_shared<SortStmt>(move(arr), u8() != 0, 0);
+            break;
+        }
+        case 24: {
+            string var = str(), arr = str();
+            s = make_shared<SearchStmt>(move(var), move(arr), expr(), 0);
+            break;
+        }
+        case 25: {
+            auto op = enumByte(StringOp::LOWER);
+            string var = str();
+            s = make_shared<StringOpStmt>(op, move(var), exprs(), 0);
+            break;
+        }
+        case 26: {
+            string name = str();
+            vector<string> params(count());
+            for (auto& p : params) p = str();
+            auto f = make_shared<FuncStmt>(move(name), move(params), 0);
+            if (inFunction) throw runtime_error("Nested function in module image");
+            inFunction = true;
+            highestSlot = -1;
+            f->body = stmts();
+            inFunction = false;
+            // Slots must number the frame 0..n-1 with the parameters first, in order
+            uint32_t frame = count();
+            vector<bool> used(frame);
+            for (uint32_t n = frame; n > 0; --n) {
+                string local = str();
+                int at = i32();
+                if (at < 0 || (uint32_t)at >= frame || used[at]) throw runtime_error("Bad slot in module image");
+                used[at] = true;
+                f->slots[local] = at;
+            }
+            if (highestSlot >= (int)frame || f->slots.size() != frame || f->params.size() > frame) {
+                throw runtime_error("Bad slot in module image");
+            }
+            for (size_t i = 0; i < f->params.size(); ++i) {
+                auto p = f->slots.find(f->params[i]);
+                if (p == f->slots.end() || p->second != (int)i) throw runtime_error("Bad slot in module image");
+            }
+            for (size_t i = 0; i < f->body.size(); ++i) f->lineToIndex[f->body[i]->line] = i;
+            if (u8()) {
+                auto r = f->body.size() == 1 ? dynamic_cast<ReturnStmt*>(f->body[0].get()) : nullptr;
+                if (!r) throw runtime_error("Bad inline function in module image");
+                f->inlineBody = r->expr;
+            }
+            functions.push_back(f.get());
+            s = f;
+            break;
         }
-        else if (auto m = dynamic_pointer_cast<MakefileStmt>(stmt)) {
-            execMakefile(m);
-            return currentIndex + 1;
+        case 27: {
+            auto r = make_shared<ReturnStmt>(expr(), 0);
+            r->tail = u8();
+            s = r;
+            break;
         }
-        else if (auto d = dynamic_pointer_cast<DelfileStmt>(stmt)) {
-            execDelfile(d);
-            return currentIndex + 1;
+        case 28:
+            s = make_shared<CallStmt>(expr(), 0);
+            break;
+        case 29: {
+            auto imp = make_shared<ImportStmt>(str(), 0);
+            imports.push_back({imp.get(), u64()});
+            s = imp;
+            break;
         }
-        else {
-            throw runtime_error("Unknown statement type");
+        default:
+            throw runtime_error("Bad statement tag in module image");
         }
+        s->line = i32();
+        return s;
     }
+};
 
-    size_t execIf(const shared_ptr<IfStmt>& stmt, const vector<StmtPtr>& program,
-                  const unordered_map<int, size_t>& lineToIndex, size_t currentIndex) {
-        for (auto& branch : stmt->branches) {
-            ExprPtr cond = branch.first;
-            auto& body = branch.second;
+// Process-wide cache of compiled modules. A module is compiled once per content
+// hash and then shared read-only; only the quickening state of its binary nodes
+// changes at runtime, and that is atomic
+class ModuleCache {
+    struct Stamp {
+        filesystem::file_time_type mtime;
+        uintmax_t size;
+        uint64_t hash;
+    };
 
-            if (!cond) {
-                // Else branch - execute all statements in else body WITHOUT advancing the global index
-                for (auto& s : body) {
-                    size_t ignore = exec(s, program, lineToIndex, currentIndex);
-                    (void)ignore;
-                }
-                return currentIndex + 1;
-            }
+    recursive_mutex mtx; // held while compiling, so each module compiles once
+    unordered_map<string, Stamp> stamps; // by canonical path, skips rereading unchanged files
+    unordered_map<uint64_t, shared_ptr<const Module>> modules; // by content hash
+    string diskDir;
 
-            auto condVal = eval(cond);
-            bool truthy = false;
-            if (holds_alternative<double>(condVal)) {
-                truthy = (get<double>(condVal) != 0);
-            } else if (holds_alternative<string>(condVal)) {
-                truthy = !get<string>(condVal).empty();
-            }
+    static inline thread_local vector<string> loading; // import chain being compiled, for cycles
 
-            if (truthy) {
-                // Execute all statements in if body WITHOUT advancing the global index
-                for (auto& s : body) {
-                    size_t ignore = exec(s, program, lineToIndex, currentIndex);
-                    (void)ignore;
+public:
+    static ModuleCache& shared() {
+        static ModuleCache cache;
+        return cache;
+    }
+
+    // Also keep compiled images in dir and reuse them across processes
+    void persistTo(const string& dir) {
+        lock_guard<recursive_mutex> lock(mtx);
+        diskDir = dir;
+    }
+
+    // Loads the modules program imports (paths relative to dir) into each ImportStmt
+    // and adds their functions to imported
+    void link(const vector<StmtPtr>& program, const string& dir, unordered_map<string, FuncStmt*>& imported,
+              vector<string>& errors) {
+        unordered_map<string, const Module*> owner;
+        for (auto& s : program) {
+            auto imp = dynamic_cast<ImportStmt*>(s.get());
+            if (!imp) continue;
+            vector<string> moduleErrors;
+            imp->module = load(importPath(dir, imp->fileName), moduleErrors);
+            if (!imp->module) {
+                errors.push_back("Error on line " + to_string(imp->line) + ": cannot import '" + imp->fileName + "'");
+                errors.insert(errors.end(), moduleErrors.begin(), moduleErrors.end());
+                continue;
+            }
+            for (auto& [name, f] : imp->module->functions) {
+                auto [it, added] = owner.emplace(name, imp->module.get());
+                if (!added && it->second != imp->module.get()) {
+                    errors.push_back("Error on line " + to_string(imp->line) + ": function '" + name +
+                                     "' is imported from both " + it->second->path + " and " + imp->module->path);
                 }
-                return currentIndex + 1;
+                imported[name] = f;
             }
         }
-        return currentIndex + 1;
-    }
-
-    void execDecl(const shared_ptr<DeclStmt>& stmt) {
-        auto val = eval(stmt->init);
-        variables[stmt->name] = val;
     }
 
-    void execAssign(const shared_ptr<AssignStmt>& stmt) {
-        auto val = eval(stmt->expr);
-        variables[stmt->name] = val;
+    // True if every module program imports is still the version it was linked against
+    bool current(const vector<StmtPtr>& program, const string& dir) {
+        for (auto& s : program) {
+            auto imp = dynamic_cast<ImportStmt*>(s.get());
+            if (!imp) continue;
+            vector<string> errors;
+            if (load(importPath(dir, imp->fileName), errors) != imp->module) return false;
+        }
+        return true;
     }
 
-    void execArrayAssign(const shared_ptr<ArrayAssignStmt>& stmt) {
-        // Find the array variable
-        auto it = variables.find(stmt->arrayName);
-        if (it == variables.end()) {
-            throw runtime_error("Undefined array: " + stmt->arrayName);
+    shared_ptr<const Module> load(const string& file, vector<string>& errors) {
+        namespace fs = std::filesystem;
+        error_code ec;
+        string path = fs::weakly_canonical(file, ec).string();
+        if (ec) path = file;
+        auto mtime = fs::last_write_time(path, ec);
+        uintmax_t size = ec ? 0 : fs::file_size(path, ec);
+        if (ec) {
+            errors.push_back("Cannot open file " + path);
+            return nullptr;
         }
-        
-        // Make sure it's actually an array
-        if (!holds_alternative<vector<variant<double, string>>>(it->second)) {
-            throw runtime_error("Variable " + stmt->arrayName + " is not an array");
+
+        lock_guard<recursive_mutex> lock(mtx);
+        if (find(loading.begin(), loading.end(), path) != loading.end()) {
+            string chain;
+            for (auto& p : loading) chain += p + " -> ";
+            errors.push_back("Import cycle: " + chain + path);
+            return nullptr;
         }
-        
-        // Evaluate the index
-        auto indexVal = eval(stmt->index);
-        if (!holds_alternative<double>(indexVal)) {
-            throw runtime_error("Array index must be a number");
+
+        // Unchanged file: no need to read it again
+        optional<Stamp> stamp;
+        if (auto st = stamps.find(path); st != stamps.end()) stamp = st->second;
+        if (stamp && stamp->mtime == mtime && stamp->size == size) {
+            auto it = modules.find(stamp->hash);
+            if (it != modules.end() && it->second->path == path && importsCurrent(*it->second)) return it->second;
         }
-        
-        int index = (int)get<double>(indexVal);
-        auto& array = get<vector<variant<double, string>>>(it->second);
-        
-        // Check bounds
-        if (index < 0 || index >= (int)array.size()) {
-            throw runtime_error("Array index out of bounds: " + to_string(index));
+
+        ifstream in(path, ios::binary);
+        if (!in) {
+            errors.push_back("Cannot open file " + path);
+            return nullptr;
         }
-        
-        // Evaluate the expression and assign to array element
-        auto val = eval(stmt->expr);
-        if (holds_alternative<double>(val)) {
-            array[index] = get<double>(val);
-        } else if (holds_alternative<string>(val)) {
-            array[index] = get<string>(val);
-        } else {
-            throw runtime_error("Cannot assign array to array element");
+        stringstream buffer;
+        buffer << in.rdbuf();
+        string source = buffer.str();
+        uint64_t hash = contentHash(source);
+        if (stamp && stamp->hash != hash) {
+            auto old = modules.find(stamp->hash);
+            if (old != modules.end() && old->second->path == path) modules.erase(old);
         }
-    }
-
-    void execPrint(const shared_ptr<PrintStmt>& stmt) {
-        auto val = eval(stmt->expr);
-        if (holds_alternative<double>(val)) {
-            cout << get<double>(val) << "\n";
-        } else if (holds_alternative<string>(val)) {
-            cout << get<string>(val) << "\n";
-        } else if (holds_alternative<vector<variant<double, string>>>(val)) {
-            cout << "[";
-            auto& arr = get<vector<variant<double, string>>>(val);
-            for (size_t i = 0; i < arr.size(); ++i) {
-                if (i > 0) cout << ", ";
-                if (holds_alternative<double>(arr[i])) {
-                    cout << get<double>(arr[i]);
-                } else {
-                    cout << get<string>(arr[i]);
-                }
+        stamps[path] = {mtime, size, hash};
+
+        auto it = modules.find(hash);
+        if (it != modules.end() && it->second->path == path && importsCurrent(*it->second)) return it->second;
+
+        loading.push_back(path);
+        shared_ptr<const Module> module;
+        try {
+            module = readImage(path, hash);
+            if (!module) {
+                module = compile(path, source, hash, errors);
+                if (module) writeImage(*module);
             }
-            cout << "]\n";
+        } catch (...) {
+            loading.pop_back();
+            throw;
         }
+        loading.pop_back();
+        if (!module) return nullptr;
+        modules[hash] = module;
+        return module;
     }
 
-    void execInput(const shared_ptr<InputStmt>& stmt) {
-        cout << stmt->question << " ";
-        string userInput;
-        getline(cin, userInput);
+private:
+    static string importPath(const string& dir, const string& fileName) {
+        namespace fs = std::filesystem;
+        fs::path p(fileName);
+        return p.is_absolute() ? p.string() : (fs::path(dir) / p).string();
+    }
 
-        // If var was declared as number → convert
-        if (variables.find(stmt->name) != variables.end() &&
-            holds_alternative<double>(variables[stmt->name])) {
-            variables[stmt->name] = stod(userInput);
-        } else {
-            variables[stmt->name] = userInput;
-        }
+    static string dirOf(const string& path) {
+        return filesystem::path(path).parent_path().string();
     }
 
-    void execRandom(const shared_ptr<RandomStmt>& stmt) {
-        std::random_device rd;
-        std::mt19937 gen(rd());
-        std::uniform_int_distribution<> dist(stmt->min, stmt->max);
-        double val = dist(gen);
-        variables[stmt->name] = val;
+    bool importsCurrent(const Module& m) {
+        return current(m.program, dirOf(m.path));
     }
 
-    void execRead(const shared_ptr<ReadStmt>& stmt) {
-        ifstream file(stmt->fileName);
-        if (!file.is_open()) {
-            throw runtime_error("Cannot open file " + stmt->fileName);
+    shared_ptr<const Module> compile(const string& path, const string& source, uint64_t hash, vector<string>& errors) {
+        auto m = make_shared<Module>();
+        m->path = path;
+        m->hash = hash;
+        vector<string> moduleErrors;
+        try {
+            Parser parser(tokenizeParallel(source));
+            m->program = parser.parseProgram();
+            unordered_map<string, FuncStmt*> imported;
+            link(m->program, dirOf(path), imported, moduleErrors);
+            if (moduleErrors.empty()) moduleErrors = FunctionResolver().resolve(m->program, imported, true);
+            if (moduleErrors.empty()) moduleErrors = TypeChecker().check(m->program);
+        } catch (const exception& e) {
+            moduleErrors.push_back(e.what());
         }
-        vector<string> lines;
-        string line;
-        while (getline(file, line)) {
-            lines.push_back(line);
+        if (!moduleErrors.empty()) {
+            for (auto& e : moduleErrors) errors.push_back(path + ": " + e);
+            return nullptr;
         }
-        file.close();
-        vector<variant<double, string>> arr;
-        for (auto& l : lines) {
-            arr.push_back(l);
+        for (auto& s : m->program) {
+            if (auto f = dynamic_cast<FuncStmt*>(s.get())) m->functions[f->name] = f;
         }
-        variables[stmt->varName] = arr;
+        return m;
     }
 
-    void execLength(const shared_ptr<LengthStmt>& stmt) {
-        // Look up the array variable
-        auto it = variables.find(stmt->ArrayName);
-        if (it == variables.end()) {
-            throw runtime_error("Undefined variable: " + stmt->ArrayName);
+    string imagePath(uint64_t hash) const {
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.sprc", (unsigned long long)hash);
+        return (filesystem::path(diskDir) / name).string();
+    }
+
+    // A missing, stale or damaged image is not an error: the module is compiled instead
+    shared_ptr<const Module> readImage(const string& path, uint64_t hash) {
+        if (diskDir.empty()) return nullptr;
+        ifstream in(imagePath(hash), ios::binary);
+        if (!in) return nullptr;
+        stringstream buffer;
+        buffer << in.rdbuf();
+        string data = buffer.str();
+
+        auto m = make_shared<Module>();
+        m->path = path;
+        m->hash = hash;
+        try {
+            ModuleReader reader(data);
+            if (!reader.read(hash, m->program)) return nullptr;
+
+            // The image inlined and linked against its imports as they were then
+            unordered_map<string, FuncStmt*> imported;
+            for (auto& imp : reader.imports) {
+                vector<string> errors;
+                imp.stmt->module = load(importPath(dirOf(path), imp.stmt->fileName), errors);
+                if (!imp.stmt->module || imp.stmt->module->hash != imp.hash) return nullptr;
+                for (auto& [name, f] : imp.stmt->module->functions) imported[name] = f;
+            }
+            for (FuncStmt* f : reader.functions) m->functions[f->name] = f;
+            for (CallExpr* c : reader.calls) {
+                auto own = m->functions.find(c->name);
+                if (own != m->functions.end()) c->fn = own->second;
+                else if (auto it = imported.find(c->name); it != imported.end()) c->fn = it->second;
+                if (!c->fn || c->fn->params.size() != c->args.size()) return nullptr;
+            }
+        } catch (const exception&) {
+            return nullptr;
         }
+        return m;
+    }
 
-        // Make sure it's actually an array
-        if (!holds_alternative<vector<variant<double, string>>>(it->second)) {
-            throw runtime_error("Variable " + stmt->ArrayName + " is not an array");
+    void writeImage(const Module& m) {
+        if (diskDir.empty()) return;
+        namespace fs = std::filesystem;
+        string target = imagePath(m.hash);
+        error_code ec;
+        // Written under a private name and renamed, so readers never see half an image
+        string temp = target + "." + to_string(random_device{}()) + ".tmp";
+        {
+            ofstream out(temp, ios::binary);
+            string data = ModuleWriter().write(m);
+            out.write(data.data(), data.size());
+            if (!out) {
+                out.close();
+                fs::remove(temp, ec);
+                return;
+            }
         }
+        fs::rename(temp, target, ec);
+        if (ec) fs::remove(temp, ec);
+    }
+};
 
-        // Get the actual size of the array
-        auto& array = get<vector<variant<double, string>>>(it->second);
-        double len = array.size();
-        variables[stmt->varName] = len;
+// Lex, parse and (optionally) type-check a script. Imports are resolved
+// relative to dir. Type errors are returned through errors, with an empty program
+vector<StmtPtr> compileProgram(const string& source, bool typecheck, vector<string>& errors, const string& dir) {
+    // Heap growth across each phase, for --mem-report; approximate if other threads allocate meanwhile
+    int64_t start = MemoryMeter::live.load(memory_order_relaxed);
+    vector<Token> tokens = tokenizeParallel(source);
+    int64_t lexed = MemoryMeter::live.load(memory_order_relaxed);
+
+    Parser parser(move(tokens));
+    vector<StmtPtr> program = parser.parseProgram();
+    MemoryMeter::tokens += (size_t)max<int64_t>(lexed - start, 0);
+    MemoryMeter::syntaxTree += (size_t)max<int64_t>(MemoryMeter::live.load(memory_order_relaxed) - lexed, 0);
+
+    unordered_map<string, FuncStmt*> imported;
+    ModuleCache::shared().link(program, dir, imported, errors);
+    if (!errors.empty()) return {};
+
+    FunctionResolver resolver;
+    errors = resolver.resolve(program, imported);
+    if (!errors.empty()) return {};
+
+    if (typecheck) {
+        TypeChecker checker;
+        errors = checker.check(program);
+        if (!errors.empty()) return {};
     }
+    return program;
+}
 
-    void execWrite(const shared_ptr<WriteStmt>& stmt) {
-        // Look up the array variable
-        auto it = variables.find(stmt->ArrayName);
-        if (it == variables.end()) {
-            throw runtime_error("Undefined variable: " + stmt->ArrayName);
-        }
-        vector<variant<double, string>> arr = get<vector<variant<double, string>>>(it->second);
+#ifndef _WIN32
+/* =====================
+   SERVER MODE
+   - sprout --serve <socket>: keeps parsed programs cached and runs
+     submitted scripts on worker threads
+   - sprout --client <socket> <script>: thin client that forwards stdin
+     and streams stdout/stderr and the exit status back
+   ===================== */
 
-        fstream file(stmt->fileName);
-        if (!file.is_open()) {
-            throw runtime_error("Cannot open file " + stmt->fileName);
-        }
-        string line;
-        for (auto s : arr) {
-            string temp;
-            if (holds_alternative<double>(s)) {
-                temp = std::to_string(get<double>(s));
-            }
-            else if (holds_alternative<string>(s)) {
-                temp = get<string>(s);
-            }
-            file << temp << "\n";
-        }
+// Every message is a frame: tag byte, 4-byte little-endian length, payload
+enum FrameTag : char {
+    FRAME_RUN = 'R',    // client -> server: "cwd\0script path"
+    FRAME_STDOUT = 'O', // server -> client
+    FRAME_STDERR = 'E', // server -> client
+    FRAME_INPUT = 'I',  // server -> client: the script wants more stdin
+    FRAME_DATA = 'D',   // client -> server: stdin bytes, empty at EOF
+    FRAME_EXIT = 'X'    // server -> client: status and timings, always last
+};
 
-        file.close();
+static bool sendAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= (size_t)n;
     }
+    return true;
+}
+
+static bool sendFrame(int fd, char tag, const char* data, size_t len) {
+    char header[5] = {tag, (char)(len & 0xff), (char)((len >> 8) & 0xff),
+                      (char)((len >> 16) & 0xff), (char)((len >> 24) & 0xff)};
+    return sendAll(fd, header, sizeof header) && (len == 0 || sendAll(fd, data, len));
+}
+
+static bool recvFrame(int fd, char& tag, string& payload) {
+    unsigned char header[5];
+    if (!recvAll(fd, (char*)header, sizeof header)) return false;
+    tag = (char)header[0];
+    size_t len = header[1] | (header[2] << 8) | (header[3] << 16) | ((size_t)header[4] << 24);
+    payload.resize(len);
+    return len == 0 || recvAll(fd, payload.data(), len);
+}
+
+static void putU64(string& out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) out += (char)((v >> (8 * i)) & 0xff);
+}
+
+static uint64_t getU64(const string& in, size_t at) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= (uint64_t)(unsigned char)in[at + i] << (8 * i);
+    return v;
+}
+
+// Output stream buffer that ships its contents to the client as frames
+class FrameOutBuf : public streambuf {
+    int fd;
+    char tag;
+    char buf[4096];
 
-    void execMakefile(const shared_ptr<MakefileStmt>& stmt) {
-        string filename;
-        filename = stmt->filename;
-        ofstream file(filename);
-        if (!file.is_open()) {
-            cout << "Cannot create file" + filename + "\n";
+public:
+    FrameOutBuf(int f, char t) : fd(f), tag(t) { setp(buf, buf + sizeof buf); }
+    ~FrameOutBuf() override { sync(); }
+
+protected:
+    int overflow(int c) override {
+        if (sync() != 0) return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = (char)c;
+            pbump(1);
         }
-        file << std::endl;
-        file.close();
+        return traits_type::not_eof(c);
     }
 
-    void execDelfile(const shared_ptr<DelfileStmt>& stmt) {
-        string filename;
-        filename = stmt->filename;
-        remove(filename.c_str());
+    int sync() override {
+        size_t n = pptr() - pbase();
+        if (n > 0 && !sendFrame(fd, tag, pbase(), n)) return -1; // client went away
+        setp(buf, buf + sizeof buf);
+        return 0;
     }
+};
 
-    // === Expression Evaluation ===
-    variant<double, string, vector<variant<double, string>>> eval(const ExprPtr& expr) {
-        if (auto n = dynamic_pointer_cast<NumberExpr>(expr)) {
-            return n->value;
+// Input stream buffer that asks the client for more stdin when it runs dry
+class FrameInBuf : public streambuf {
+    int fd;
+    string data;
+    bool eof = false;
+
+public:
+    explicit FrameInBuf(int f) : fd(f) {}
+
+protected:
+    int underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (eof) return traits_type::eof();
+        char tag;
+        if (!sendFrame(fd, FRAME_INPUT, nullptr, 0)) {
+            eof = true;
+            return traits_type::eof();
         }
-        if (auto s = dynamic_pointer_cast<StringExpr>(expr)) {
-            return s->value;
+        // In coroutine mode other scripts run until the client answers
+        if (auto sched = Scheduler::current()) sched->waitReadable(fd);
+        if (!recvFrame(fd, tag, data) || tag != FRAME_DATA || data.empty()) {
+            eof = true;
+            return traits_type::eof();
         }
-        if (auto a = dynamic_pointer_cast<ArrayExpr>(expr)) {
-            vector<variant<double, string>> values;
-            for (auto& v : a->values) {
-                auto result = eval(v);
-                if (holds_alternative<double>(result)) {
-                    values.push_back(get<double>(result));
-                } else if (holds_alternative<string>(result)) {
-                    values.push_back(get<string>(result));
-                } else if (holds_alternative<vector<variant<double, string>>>(result)) {
-                    // For nested arrays, we could either flatten them or convert to string
-                    // For simplicity, let's convert nested arrays to string representation
-                    values.push_back(toString(result));
+        setg(data.data(), data.data(), data.data() + data.size());
+        return traits_type::to_int_type(*gptr());
+    }
+};
+
+// Parsed programs by script path, reused while the file's mtime and size are unchanged.
+// AST nodes carry runtime state (quickening), so a cached program is lent to one
+// request at a time; a request that finds it busy compiles a private copy
+class ProgramCache {
+    struct Entry {
+        filesystem::file_time_type mtime;
+        uintmax_t size;
+        vector<StmtPtr> program;
+        // Set while lent out. Not a mutex: coroutines share one thread, and a
+        // thread must not try_lock a mutex it already holds
+        atomic<bool> busy{false};
+    };
+    mutex mtx;
+    unordered_map<string, shared_ptr<Entry>> entries;
+    bool typecheck;
+
+public:
+    explicit ProgramCache(bool tc) : typecheck(tc) {}
+
+    struct Lease {
+        vector<StmtPtr> program;
+        shared_ptr<Entry> entry; // set while a cached program is borrowed
+        bool hit = false;
+        ~Lease() {
+            if (entry) entry->busy.store(false, memory_order_release);
+        }
+    };
+
+    // Fills lease with a program ready to run; returns false with errors on load failure
+    bool acquire(const string& path, Lease& lease, vector<string>& errors) {
+        namespace fs = std::filesystem;
+        error_code ec;
+        auto mtime = fs::last_write_time(path, ec);
+        uintmax_t size = ec ? 0 : fs::file_size(path, ec);
+        if (ec) {
+            errors.push_back("Cannot open file " + path);
+            return false;
+        }
+        string dir = fs::path(path).parent_path().string();
+
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = entries.find(path);
+            if (it != entries.end() && it->second->mtime == mtime && it->second->size == size &&
+                !it->second->busy.exchange(true, memory_order_acquire)) {
+                // The script is unchanged, but it must be recompiled if a module it imports was edited
+                if (ModuleCache::shared().current(it->second->program, dir)) {
+                    lease.entry = it->second;
+                    lease.program = lease.entry->program;
+                    lease.hit = true;
+                    return true;
                 }
+                it->second->busy.store(false, memory_order_release);
             }
-            return values;
         }
-        if (auto aa = dynamic_pointer_cast<ArrayAccessExpr>(expr)) {
-            // Find the array variable
-            auto it = variables.find(aa->arrayName);
-            if (it == variables.end()) {
-                throw runtime_error("Undefined array: " + aa->arrayName);
-            }
-            
-            // Make sure it's actually an array
-            if (!holds_alternative<vector<variant<double, string>>>(it->second)) {
-                throw runtime_error("Variable " + aa->arrayName + " is not an array");
-            }
-            
-            // Evaluate the index
-            auto indexVal = eval(aa->index);
-            if (!holds_alternative<double>(indexVal)) {
-                throw runtime_error("Array index must be a number");
-            }
-            
-            int index = (int)get<double>(indexVal);
-            auto& array = get<vector<variant<double, string>>>(it->second);
-            
-            // Check bounds
-            if (index < 0 || index >= (int)array.size()) {
-                throw runtime_error("Array index out of bounds: " + to_string(index));
+
+        ifstream in(path, ios::binary);
+        if (!in) {
+            errors.push_back("Cannot open file " + path);
+            return false;
+        }
+        stringstream buffer;
+        buffer << in.rdbuf();
+        lease.program = compileProgram(buffer.str(), typecheck, errors, dir);
+        if (!errors.empty()) return false;
+
+        // Cache this compilation unless another request already refreshed the entry
+        auto entry = make_shared<Entry>();
+        entry->mtime = mtime;
+        entry->size = size;
+        entry->program = lease.program;
+        entry->busy.store(true, memory_order_relaxed);
+        lock_guard<mutex> lock(mtx);
+        auto& slot = entries[path];
+        if (!slot || slot->mtime != mtime || slot->size != size ||
+            !ModuleCache::shared().current(slot->program, dir)) {
+            slot = entry;
+            lease.entry = entry;
+        }
+        return true;
+    }
+};
+
+class Server {
+    string socketPath;
+    bool asyncIo;
+    bool coroutines; // run every request on one event loop thread instead of a worker pool
+    ProgramCache cache;
+
+    mutex queueMtx;
+    condition_variable queueCv;
+    deque<int> clients;
+
+    mutex logMtx;
+    uint64_t requests = 0, hits = 0, totalMicros = 0;
+
+public:
+    Server(string path, bool typecheck, bool async, bool coro)
+        : socketPath(move(path)), asyncIo(async), coroutines(coro), cache(typecheck) {}
+
+    int run(unsigned workers) {
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (listenFd < 0 || socketPath.size() >= sizeof addr.sun_path) {
+            cerr << "Cannot create socket " << socketPath << "\n";
+            return 1;
+        }
+        strncpy(addr.sun_path, socketPath.c_str(), sizeof addr.sun_path - 1);
+        unlink(socketPath.c_str());
+        if (bind(listenFd, (sockaddr*)&addr, sizeof addr) < 0 || listen(listenFd, 128) < 0) {
+            cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << "\n";
+            close(listenFd);
+            return 1;
+        }
+        if (coroutines) {
+            cerr << "Sprout server listening on " << socketPath << " with coroutines on one thread\n";
+            Scheduler sched;
+            sched.spawn([this, &sched, listenFd] { acceptLoop(sched, listenFd); });
+            sched.run();
+            close(listenFd);
+            return 1;
+        }
+        cerr << "Sprout server listening on " << socketPath << " with " << workers << " workers\n";
+
+        vector<thread> pool;
+        for (unsigned i = 0; i < workers; ++i) pool.emplace_back([this] { workerLoop(); });
+        while (true) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                cerr << "accept failed: " << strerror(errno) << "\n";
+                break;
             }
-            
-            // Return the element (convert single element back to our 3-type variant)
-            if (holds_alternative<double>(array[index])) {
-                return get<double>(array[index]);
-            } else {
-                return get<string>(array[index]);
+            {
+                lock_guard<mutex> lock(queueMtx);
+                clients.push_back(fd);
             }
+            queueCv.notify_one();
         }
-        if (auto v = dynamic_pointer_cast<VarExpr>(expr)) {
-            // STRICT LOOKUP: do not default-initialize missing variables
-            auto it = variables.find(v->name);
-            if (it == variables.end()) {
-                throw runtime_error("Undefined variable: " + v->name);
+        close(listenFd);
+        for (auto& t : pool) t.detach();
+        return 1;
+    }
+
+private:
+    void acceptLoop(Scheduler& sched, int listenFd) {
+        while (true) {
+            sched.waitReadable(listenFd);
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) continue;
+                cerr << "accept failed: " << strerror(errno) << "\n";
+                return;
             }
-            return it->second;
+            sched.spawn([this, fd] {
+                handle(fd);
+                close(fd);
+            });
         }
-        if (auto b = dynamic_pointer_cast<BinaryExpr>(expr)) {
-            auto left = eval(b->left);
-            auto right = eval(b->right);
+    }
 
-            // arithmetic on numbers
-            if (holds_alternative<double>(left) && holds_alternative<double>(right)) {
-                double l = get<double>(left);
-                double r = get<double>(right);
-                if (b->op == "+") return l + r;
-                if (b->op == "-") return l - r;
-                if (b->op == "*") return l * r;
-                if (b->op == "/") return l / r;
-                if (b->op == "<") return (l < r) ? 1.0 : 0.0;
-                if (b->op == ">") return (l > r) ? 1.0 : 0.0;
-                if (b->op == "==") return (l == r) ? 1.0 : 0.0;
-                if (b->op == "<=") return (l <= r) ? 1.0 : 0.0;
-                if (b->op == ">=") return (l >= r) ? 1.0 : 0.0;
-                if (b->op == "!=") return (l != r) ? 1.0 : 0.0;
-            }
-
-            // string comparisons
-            if (holds_alternative<string>(left) && holds_alternative<string>(right)) {
-                string l = get<string>(left);
-                string r = get<string>(right);
-                if (b->op == "==") return (l == r) ? 1.0 : 0.0;
-                if (b->op == "!=") return (l != r) ? 1.0 : 0.0;
-                if (b->op == "<") return (l < r) ? 1.0 : 0.0;
-                if (b->op == ">") return (l > r) ? 1.0 : 0.0;
-                if (b->op == "<=") return (l <= r) ? 1.0 : 0.0;
-                if (b->op == ">=") return (l >= r) ? 1.0 : 0.0;
-            }
-
-            // string concatenation with +
-            if (b->op == "+") {
-                string l = toString(left);
-                string r = toString(right);
-                return l + r;
+    void workerLoop() {
+        while (true) {
+            int fd;
+            {
+                unique_lock<mutex> lock(queueMtx);
+                queueCv.wait(lock, [this] { return !clients.empty(); });
+                fd = clients.front();
+                clients.pop_front();
             }
+            handle(fd);
+            close(fd);
         }
-        return 0.0; // fallback
     }
 
-    string toString(const variant<double, string, vector<variant<double, string>>>& val) {
-        if (holds_alternative<double>(val)) {
-            double num = get<double>(val);
-            if (num == (int)num) {
-                return to_string((int)num); // no decimals if whole number
-            }
-            return to_string(num);
-        } else if (holds_alternative<string>(val)) {
-            return get<string>(val);
-        } else if (holds_alternative<vector<variant<double, string>>>(val)) {
-            string result = "[";
-            auto& arr = get<vector<variant<double, string>>>(val);
-            for (size_t i = 0; i < arr.size(); ++i) {
-                if (i > 0) result += ", ";
-                if (holds_alternative<double>(arr[i])) {
-                    double num = get<double>(arr[i]);
-                    if (num == (int)num) {
-                        result += to_string((int)num);
-                    } else {
-                        result += to_string(num);
-                    }
+    void handle(int fd) {
+        using clock = chrono::steady_clock;
+        char tag;
+        string request;
+        if (!recvFrame(fd, tag, request) || tag != FRAME_RUN) return;
+        size_t sep = request.find('\0');
+        string cwd = request.substr(0, sep);
+        string path = sep == string::npos ? string() : request.substr(sep + 1);
+
+        auto start = clock::now();
+        int status = 0;
+        bool hit = false;
+        auto loaded = start;
+        {
+            FrameOutBuf outBuf(fd, FRAME_STDOUT), errBuf(fd, FRAME_STDERR);
+            FrameInBuf inBuf(fd);
+            ostream out(&outBuf), err(&errBuf);
+            istream in(&inBuf);
+            in.tie(&out); // flush prompts before asking the client for input
+
+            ProgramCache::Lease lease;
+            vector<string> errors;
+            try {
+                bool ok = cache.acquire(path, lease, errors);
+                loaded = clock::now();
+                if (ok) {
+                    hit = lease.hit;
+                    Interpreter interpreter(out, err, in);
+                    interpreter.setBaseDir(cwd);
+                    if (Scheduler::current()) interpreter.setStackBudget(Scheduler::STACK_SIZE / 2);
+                    if (asyncIo) interpreter.enableAsyncIo(4);
+                    interpreter.run(lease.program);
                 } else {
-                    result += get<string>(arr[i]);
+                    for (const auto& e : errors) err << e << "\n";
+                    status = 1;
                 }
+            } catch (const exception& e) {
+                err << "Error: " << e.what() << "\n";
+                status = 1;
             }
-            result += "]";
-            return result;
+            out.flush();
+            err.flush();
         }
-        return "";
+        auto end = clock::now();
+        uint64_t loadMicros = chrono::duration_cast<chrono::microseconds>(loaded - start).count();
+        uint64_t execMicros = chrono::duration_cast<chrono::microseconds>(end - loaded).count();
+
+        string exitFrame;
+        putU64(exitFrame, (uint64_t)(int64_t)status);
+        putU64(exitFrame, hit ? 1 : 0);
+        putU64(exitFrame, loadMicros);
+        putU64(exitFrame, execMicros);
+        sendFrame(fd, FRAME_EXIT, exitFrame.data(), exitFrame.size());
+
+        // Coroutine mode: what this script's stack used, and what the waiting ones hold
+        string memory;
+        if (auto sched = Scheduler::current()) {
+            auto [waiting, bytes] = sched->suspendedMemory();
+            memory = ", stack " + to_string(sched->stackResident() / 1024) + " KiB; " + to_string(waiting) +
+                     " suspended using " + to_string(bytes / 1024) + " KiB";
+        }
+
+        lock_guard<mutex> lock(logMtx);
+        requests++;
+        hits += hit;
+        totalMicros += loadMicros + execMicros;
+        cerr << path << ": status " << status << (hit ? ", cached" : ", compiled") << ", load "
+             << loadMicros << "us, exec " << execMicros << "us" << memory << " (" << requests << " requests, "
+             << hits << " cache hits, avg " << totalMicros / requests << "us)\n";
     }
 };
 
+// Run one script on the server; returns the script's exit status
+int runClient(const string& socketPath, const string& scriptPath, bool showLatency) {
+    using clock = chrono::steady_clock;
+    auto start = clock::now();
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof addr.sun_path - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof addr) < 0) {
+        cerr << "Cannot connect to Sprout server at " << socketPath << "\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    string request = filesystem::current_path().string() + '\0' + filesystem::absolute(scriptPath).string();
+    if (!sendFrame(fd, FRAME_RUN, request.data(), request.size())) {
+        cerr << "Lost connection to Sprout server\n";
+        close(fd);
+        return 1;
+    }
+
+    char tag;
+    string payload;
+    vector<char> stdinBuf(1 << 16);
+    while (recvFrame(fd, tag, payload)) {
+        if (tag == FRAME_STDOUT) {
+            cout.write(payload.data(), payload.size());
+        } else if (tag == FRAME_STDERR) {
+            cerr.write(payload.data(), payload.size());
+        } else if (tag == FRAME_INPUT) {
+            cout.flush();
+            ssize_t n = read(0, stdinBuf.data(), stdinBuf.size());
+            sendFrame(fd, FRAME_DATA, stdinBuf.data(), n > 0 ? (size_t)n : 0);
+        } else if (tag == FRAME_EXIT && payload.size() >= 32) {
+            close(fd);
+            cout.flush();
+            int status = (int)(int64_t)getU64(payload, 0);
+            if (showLatency) {
+                double total = chrono::duration<double, milli>(clock::now() - start).count();
+                cerr << "latency: " << total << " ms round trip (server: "
+                     << (getU64(payload, 8) ? "cached" : "compiled") << ", load "
+                     << getU64(payload, 16) / 1000.0 << " ms, exec " << getU64(payload, 24) / 1000.0 << " ms)\n";
+            }
+            return status;
+        }
+    }
+    close(fd);
+    cerr << "Lost connection to Sprout server\n";
+    return 1;
+}
+#endif
+
+// Option value in bytes, or with a K, M or G suffix
+static bool parseBytes(const string& option, const string& text, size_t& bytes) {
+    size_t digits = 0;
+    unsigned long long n = 0;
+    try {
+        n = stoull(text, &digits);
+    } catch (const exception&) {
+        digits = 0;
+    }
+    string unit = text.substr(digits);
+    int shift = unit.empty() ? 0 : unit == "K" ? 10 : unit == "M" ? 20 : unit == "G" ? 30 : -1;
+    if (digits == 0 || shift < 0) {
+        cerr << "Bad " << option << " " << text << ", expected bytes with an optional K, M or G suffix\n";
+        return false;
+    }
+    bytes = (size_t)n << shift;
+    return true;
+}
+
 int main(int argc, char* argv[]) {
     namespace fs = std::filesystem;
 
     // Collect candidate paths from CLI args; prefer @file:... entries
     vector<string> candidates;
+    bool quickenStats = false;
+    bool arenaStats = false;
+    bool fileCacheStats = false;
+    bool memReport = false;
+    bool typecheck = true;
+    bool asyncIo = false;
+    string serveSocket, clientSocket;
+    bool showLatency = false;
+    bool coroutines = false;
     for (int i = 1; i < argc; ++i) {
         string a = argv[i];
-        if (a.rfind("@file:", 0) == 0) {
+        if (a == "--module-cache" && i + 1 < argc) {
+            string dir = argv[++i];
+            error_code ec;
+            fs::create_directories(dir, ec);
+            if (ec) {
+                cerr << "Cannot create module cache directory " << dir << "\n";
+                return 1;
+            }
+            ModuleCache::shared().persistTo(dir);
+        } else if (a == "--spill-limit" && i + 1 < argc) {
+            if (!parseBytes(a, argv[++i], SpillArray::limit)) return 1;
+        } else if (a == "--file-cache" && i + 1 < argc) {
+            if (!parseBytes(a, argv[++i], FileCache::budget)) return 1;
+        } else if (a == "--file-cache-stats") {
+            fileCacheStats = true;
+        } else if (a == "--mem-report") {
+            memReport = true;
+        } else if (a == "--max-memory" && i + 1 < argc) {
+#ifdef SPROUT_HAVE_MEMORY_METER
+            if (!parseBytes(a, argv[++i], MemoryMeter::limit)) return 1;
+#else
+            cerr << "--max-memory is not supported on this platform\n";
+            return 1;
+#endif
+        } else if (a == "--spill-dir" && i + 1 < argc) {
+            SpillArray::directory = argv[++i];
+        } else if (a == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        } else if (a == "--client" && i + 1 < argc) {
+            clientSocket = argv[++i];
+        } else if (a == "--latency") {
+            showLatency = true;
+        } else if (a == "--coroutines") {
+            coroutines = true;
+        } else if (a == "--quicken-stats") {
+            quickenStats = true;
+            BinaryExpr::countHits = true;
+        } else if (a == "--arena-stats") {
+            arenaStats = true;
+        } else if (a == "--no-typecheck") {
+            typecheck = false;
+        } else if (a == "--async-io") {
+            asyncIo = true;
+        } else if (a.rfind("@file:", 0) == 0) {
             candidates.push_back(a.substr(6));
         } else if (!a.empty() && a[0] != '@') {
             candidates.push_back(a);
         }
         // ignore markers like @thisFile
     }
+
+    if (!serveSocket.empty()) {
+        // The cap counts the whole process, so one script could fail another's statements
+        if (MemoryMeter::limit) {
+            cerr << "--max-memory cannot be used with --serve\n";
+            return 1;
+        }
+#ifndef _WIN32
+        Server server(serveSocket, typecheck, asyncIo, coroutines);
+        return server.run(max(2u, thread::hardware_concurrency()));
+#else
+        cerr << "--serve is not supported on Windows\n";
+        return 1;
+#endif
+    }
+
     // Default fallbacks if nothing provided or none valid
     if (candidates.empty()) {
         candidates.push_back("test.spt");
@@ -1202,18 +7588,47 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (!clientSocket.empty()) {
+#ifndef _WIN32
+        return runClient(clientSocket, openedPath, showLatency);
+#else
+        cerr << "--client is not supported on Windows\n";
+        return 1;
+#endif
+    }
+
     stringstream buffer;
     buffer << in.rdbuf();
     string source = buffer.str();
 
-    Lexer lexer(source);
-    vector<Token> tokens = lexer.tokenize();
-
-    Parser parser(tokens);
-    vector<StmtPtr> program = parser.parseProgram();
+    vector<string> typeErrors;
+    vector<StmtPtr> program;
+    try {
+        program = compileProgram(source, typecheck, typeErrors, fs::path(openedPath).parent_path().string());
+    } catch (const exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    if (!typeErrors.empty()) {
+        for (const auto& e : typeErrors) cerr << e << "\n";
+        return 1;
+    }
 
     Interpreter interpreter;
-    interpreter.run(program);
+    if (asyncIo) interpreter.enableAsyncIo(4);
+    int status = 0;
+    try {
+        interpreter.run(program);
+    } catch (const exception& e) {
+        // Reported like server mode does, so the reports below still print
+        cout.flush();
+        cerr << "Error: " << e.what() << "\n";
+        status = 1;
+    }
+    if (quickenStats) interpreter.printQuickenStats(program, cerr);
+    if (arenaStats) interpreter.printArenaStats(cerr);
+    if (fileCacheStats) FileCache::shared().printStats(cerr);
+    if (memReport) interpreter.printMemoryReport(cerr);
 
-    return 0;
+    return status;
 }
\ No newline at end of file